@@ -0,0 +1,104 @@
+#include <fstream>
+#include <iostream>
+
+#include "batch.hpp"
+#include "json.hpp"
+
+using namespace std;
+
+namespace chroot_venv {
+
+// JSON is close enough to YAML flow syntax that each line parses as a node
+static optional<vector<BatchJob>> loadJsonLines(ifstream &in, const string &path) {
+  vector<BatchJob> jobs;
+  string line;
+  for (size_t lineno = 1; getline(in, line); ++lineno) {
+    if (line.find_first_not_of(" \t\r") == string::npos) continue;
+    try {
+      jobs.push_back(YAML::Load(line).as<BatchJob>());
+    } catch (exception &e) {
+      cerr << path << ":" << lineno << ": invalid job " << e.what() << endl;
+      return nullopt;
+    }
+  }
+  return jobs;
+}
+
+optional<vector<BatchJob>> loadManifest(const string &path) {
+  ifstream in(path);
+  if (!in) {
+    cerr << "Failed to open manifest " << path << endl;
+    return nullopt;
+  }
+  in >> ws;
+  if (in.peek() == '{') return loadJsonLines(in, path);
+
+  try {
+    auto node = YAML::Load(in);
+    if (!node.IsSequence()) {
+      cerr << path << ": expected a sequence of jobs" << endl;
+      return nullopt;
+    }
+    vector<BatchJob> jobs;
+    for (size_t i = 0; i < node.size(); ++i) {
+      try {
+        jobs.push_back(node[i].as<BatchJob>());
+      } catch (exception &e) {
+        cerr << path << ": invalid job " << i << " " << e.what() << endl;
+        return nullopt;
+      }
+    }
+    return jobs;
+  } catch (exception &e) {
+    cerr << path << ": " << e.what() << endl;
+    return nullopt;
+  }
+}
+
+ostream &operator<<(ostream &os, const BatchResult &result) {
+  os << "{\"job\":" << result.job << ",\"build_root\":";
+  writeJsonString(os, result.build_root);
+  if (result.error) {
+    os << ",\"error\":";
+    writeJsonString(os, *result.error);
+    return os << "}";
+  }
+  os << ",\"status\":" << result.status << ",\"signal\":";
+  if (result.signal) os << *result.signal;
+  else os << "null";
+  return os
+    << ",\"core_dumped\":" << (result.core_dumped ? "true" : "false")
+    << ",\"timed_out\":" << (result.timed_out ? "true" : "false")
+    << ",\"seconds\":" << result.seconds << "}";
+}
+
+} // namespace
+
+namespace YAML {
+
+Node convert<chroot_venv::BatchJob>::encode(const chroot_venv::BatchJob& rhs) {
+  Node node;
+  node["build_root"] = rhs.build_root;
+  if (!rhs.command.empty()) node["command"] = rhs.command;
+  if (!rhs.env.empty()) node["env"] = rhs.env;
+  if (rhs.timeout > 0) node["timeout"] = rhs.timeout;
+  return node;
+}
+
+bool convert<chroot_venv::BatchJob>::decode(const Node &node, chroot_venv::BatchJob& rhs) {
+  if (!node.IsMap() || !node["build_root"]) return false;
+  rhs.build_root = node["build_root"].as<string>();
+  if (node["command"]) {
+    auto command = node["command"];
+    if (command.IsSequence()) {
+      rhs.command = command.as<vector<string>>();
+    } else {
+      rhs.command = { "/bin/sh", "-c", command.as<string>() };
+    }
+  }
+  if (node["env"])      rhs.env = node["env"].as<map<string, string>>();
+  if (node["timeout"])  rhs.timeout = node["timeout"].as<double>();
+  return true;
+}
+
+} // namespace
@@ -0,0 +1,54 @@
+#include <map>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include <yaml-cpp/yaml.h>
+
+#pragma once
+
+namespace chroot_venv {
+
+// One command of a batch manifest
+struct BatchJob {
+  // Relative to the binary, like <chroot-name>
+  std::string build_root;
+  // Empty runs the build root's exec or shell
+  std::vector<std::string> command;
+  // Set on top of the build root's env
+  std::map<std::string, std::string> env;
+  // Seconds before the job is sent SIGTERM, none when 0
+  double timeout = 0;
+};
+
+// Reads a manifest, either a YAML sequence of jobs or one JSON object per
+// line. Reports the first malformed job and returns nullopt.
+std::optional<std::vector<BatchJob>> loadManifest(const std::string &path);
+
+// How one job ended, written as a line of JSON
+struct BatchResult {
+  size_t job = 0;
+  std::string build_root;
+  // Set when the job could not be run at all
+  std::optional<std::string> error;
+  int status = 0;
+  std::optional<int> signal;
+  bool core_dumped = false;
+  bool timed_out = false;
+  double seconds = 0;
+};
+
+std::ostream &operator<<(std::ostream &os, const BatchResult &result);
+
+} // namespace
+
+namespace YAML {
+
+template<>
+struct convert<chroot_venv::BatchJob> {
+  static Node encode(const chroot_venv::BatchJob& rhs);
+  static bool decode(const Node &node, chroot_venv::BatchJob& rhs);
+};
+
+} // namespace
@@ -0,0 +1,304 @@
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <yaml-cpp/yaml.h>
+
+// Benchmarks launching and tearing down a synthetic build root end to end.
+// It runs chroot_venv with --trace in a user and mount namespace of its own,
+// so it runs unprivileged on any Linux box, and reports p50, p99 and max of
+// each phase of the trace, first one run at a time and then concurrently.
+//
+//   chroot_venv_bench [-n iterations] [-c concurrency] [-l layers] [-b binds]
+//                     [-t tmpfs] [-u upper] [-i] [-s] [-x chroot_venv] [work-dir]
+//
+// -i mounts in place rather than atomically, -u picks the upper mode and -x
+// the binary, by default the chroot_venv next to this one. -s adds the
+// system filesystems, cloned recursively as a user namespace cannot mount
+// them anew. Their submounts are then locked together and only go with a
+// lazy umount.
+
+using namespace std;
+namespace fs = std::filesystem;
+
+struct Options {
+  size_t iterations = 200;
+  size_t concurrency = 4;
+  size_t layers = 8;
+  size_t binds = 4;
+  size_t tmpfs = 4;
+  string upper = "persistent";
+  bool atomic = true;
+  bool system = false;
+  fs::path binary;
+  fs::path dir;
+};
+
+// Latencies in microseconds of each phase, keyed by category and name
+struct Phases {
+  map<string, vector<double>> samples;
+  // Where each phase starts on average, relative to the run
+  map<string, double> offsets;
+};
+
+[[noreturn]] static void fail(const string &message) {
+  cerr << message << " " << strerror(errno) << endl;
+  exit(1);
+}
+
+static void writeFile(const fs::path &path, const string &data) {
+  ofstream out(path);
+  out << data;
+  out.close();
+  if (out.fail()) fail("Failed to write " + path.string());
+}
+
+// Maps the caller to root of a new user namespace, whose mount namespace
+// chroot_venv then has the run of
+static void enterNamespaces() {
+  auto uid = getuid();
+  auto gid = getgid();
+  if (unshare(CLONE_NEWUSER | CLONE_NEWNS)) fail("Failed to unshare");
+  writeFile("/proc/self/setgroups", "deny");
+  writeFile("/proc/self/uid_map", "0 " + to_string(uid) + " 1");
+  writeFile("/proc/self/gid_map", "0 " + to_string(gid) + " 1");
+  if (mount("none", "/", nullptr, MS_REC | MS_PRIVATE, nullptr)) fail("Failed to make / private");
+}
+
+static void buildTree(const Options &options) {
+  auto layers = options.dir / "layers";
+  for (size_t i = 0; i < options.layers; ++i) {
+    auto data = layers / to_string(i) / "data" / to_string(i);
+    fs::create_directories(data);
+    for (size_t f = 0; f < 16; ++f) ofstream(data / ("file" + to_string(f))) << i;
+    // Shadowed by every layer above
+    ofstream(layers / to_string(i) / "shared") << i;
+  }
+
+  // The bottom layer holds the mount points, and the host's binaries are
+  // bound in for the command to run
+  auto bottom = layers / to_string(options.layers - 1);
+  for (auto dir : { "proc", "sys", "dev", "tmp" }) fs::create_directories(bottom / dir);
+  YAML::Node binds(YAML::NodeType::Map);
+  for (string dir : { "bin", "sbin", "lib", "lib32", "lib64", "libx32", "usr" }) {
+    auto host = fs::path("/") / dir;
+    if (fs::is_symlink(host)) {
+      fs::create_symlink(fs::read_symlink(host), bottom / dir);
+    } else if (fs::is_directory(host)) {
+      fs::create_directories(bottom / dir);
+      YAML::Node bind;
+      bind["src"] = host.string();
+      bind["recursive"] = true;
+      bind["readonly"] = true;
+      binds[host.string()] = bind;
+    }
+  }
+  for (size_t i = 0; i < options.binds; ++i) {
+    auto src = options.dir / "binds" / to_string(i);
+    fs::create_directories(src);
+    fs::create_directories(bottom / "bind" / to_string(i));
+    binds["/bind/" + to_string(i)] = src.string();
+  }
+  vector<string> tmpfs;
+  for (size_t i = 0; i < options.tmpfs; ++i) {
+    fs::create_directories(bottom / "tmpfs" / to_string(i));
+    tmpfs.push_back("/tmpfs/" + to_string(i));
+  }
+
+  YAML::Node config;
+  for (size_t i = 0; i < options.layers; ++i) config["lower"].push_back((layers / to_string(i)).string());
+  config["binds"] = binds;
+  config["tmpfs"] = tmpfs;
+  config["upper"] = options.upper;
+  config["atomicmount"] = options.atomic;
+  config["nosystem"] = !options.system;
+  config["recursivesystem"] = options.system;
+  config["lazyumount"] = options.system;
+
+  // One build root per concurrent run, as a mounted one is not mounted again
+  for (size_t slot = 0; slot < options.concurrency; ++slot) {
+    auto root = options.dir / ("root" + to_string(slot));
+    fs::create_directories(root);
+    writeFile(root / ".buildroot.yaml", YAML::Dump(config) + "\n");
+    fs::permissions(root / ".buildroot.yaml", fs::perms(0644));
+  }
+  // chroot_venv looks for build roots next to its own path
+  fs::create_symlink(options.binary, options.dir / "chroot_venv");
+}
+
+// Runs /bin/true in the build root of slot, tracing into trace
+static bool launch(const Options &options, size_t slot, const fs::path &trace) {
+  auto exe = (options.dir / "chroot_venv").string();
+  auto trace_arg = "--trace=" + trace.string();
+  auto root = "root" + to_string(slot);
+  auto log = options.dir / (root + ".log");
+  auto pid = fork();
+  if (pid < 0) fail("Failed to fork");
+  if (pid == 0) {
+    int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || dup2(fd, 1) < 0 || dup2(fd, 2) < 0) _exit(127);
+    execl(exe.c_str(), exe.c_str(), trace_arg.c_str(), root.c_str(), "/bin/true", nullptr);
+    _exit(127);
+  }
+  int status;
+  if (waitpid(pid, &status, 0) < 0) fail("Failed to wait");
+  if (WIFEXITED(status) && !WEXITSTATUS(status)) return true;
+  cerr << "Run in " << root << " failed:" << endl << ifstream(log).rdbuf();
+  return false;
+}
+
+// Sums the spans of each run in trace, keyed by their pid
+static void readTrace(const fs::path &trace, Phases &phases) {
+  struct Run {
+    double start = 0;
+    map<string, double> total;
+    map<string, double> first;
+  };
+  map<pid_t, Run> runs;
+  ifstream in(trace);
+  string line;
+  while (getline(in, line)) {
+    auto event = YAML::Load(line);
+    auto key = event["cat"].as<string>() + " " + event["name"].as<string>();
+    auto &run = runs[event["pid"].as<pid_t>()];
+    auto ts = event["ts"].as<double>();
+    run.total[key] += event["dur"].as<double>();
+    if (!run.first.count(key) || ts < run.first[key]) run.first[key] = ts;
+    if (key == "main run") run.start = ts;
+  }
+  for (auto &[pid, run] : runs) {
+    for (auto &[key, total] : run.total) {
+      auto &samples = phases.samples[key];
+      auto &offset = phases.offsets[key];
+      offset += (run.first[key] - run.start - offset) / (samples.size() + 1);
+      samples.push_back(total);
+    }
+  }
+}
+
+static double percentile(const vector<double> &sorted, double p) {
+  size_t rank = ceil(p * sorted.size());
+  return sorted[min(sorted.size(), max<size_t>(rank, 1)) - 1];
+}
+
+static void report(size_t concurrency, Phases &phases) {
+  vector<string> keys;
+  for (auto &[key, samples] : phases.samples) keys.push_back(key);
+  stable_sort(keys.begin(), keys.end(), [&](auto &a, auto &b) {
+    return phases.offsets[a] < phases.offsets[b];
+  });
+
+  cout << endl << "concurrency " << concurrency << ", microseconds" << endl;
+  cout
+    << left << setw(24) << "phase"
+    << right << setw(8) << "runs" << setw(12) << "p50" << setw(12) << "p99" << setw(12) << "max" << endl;
+  for (auto &key : keys) {
+    auto &samples = phases.samples[key];
+    sort(samples.begin(), samples.end());
+    cout
+      << left << setw(24) << key
+      << right << setw(8) << samples.size() << fixed << setprecision(1)
+      << setw(12) << percentile(samples, 0.5)
+      << setw(12) << percentile(samples, 0.99)
+      << setw(12) << samples.back() << endl;
+  }
+}
+
+// Runs iterations launches, concurrency at a time, after one untimed
+// launch per build root
+static void runRound(const Options &options, size_t concurrency) {
+  vector<fs::path> traces;
+  for (size_t slot = 0; slot < concurrency; ++slot) {
+    if (!launch(options, slot, options.dir / "warmup.jsonl")) exit(1);
+    traces.push_back(options.dir / ("trace." + to_string(concurrency) + "." + to_string(slot) + ".jsonl"));
+    fs::remove(traces.back());
+  }
+
+  atomic<size_t> next = 0;
+  atomic<bool> failed = false;
+  vector<vector<double>> launches(concurrency);
+  vector<thread> pool;
+  for (size_t slot = 0; slot < concurrency; ++slot) {
+    pool.emplace_back([&, slot] {
+      while (!failed && next++ < options.iterations) {
+        auto start = chrono::steady_clock::now();
+        if (!launch(options, slot, traces[slot])) failed = true;
+        launches[slot].push_back(chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+      }
+    });
+  }
+  for (auto &t : pool) t.join();
+  if (failed) exit(1);
+
+  Phases phases;
+  for (auto &trace : traces) readTrace(trace, phases);
+  // From fork to reaping the process, around everything the trace sees
+  auto &samples = phases.samples["bench launch"];
+  for (auto &slot : launches) samples.insert(samples.end(), slot.begin(), slot.end());
+  phases.offsets["bench launch"] = -1;
+  report(concurrency, phases);
+}
+
+int main(int argc, char *argv[]) {
+  Options options;
+  options.binary = fs::canonical("/proc/self/exe").parent_path() / "chroot_venv";
+  int opt;
+  while ((opt = getopt(argc, argv, "n:c:l:b:t:u:isx:")) != -1) {
+    switch (opt) {
+      case 'n': options.iterations = stoul(optarg); break;
+      case 'c': options.concurrency = max<size_t>(stoul(optarg), 1); break;
+      case 'l': options.layers = max<size_t>(stoul(optarg), 1); break;
+      case 'b': options.binds = stoul(optarg); break;
+      case 't': options.tmpfs = stoul(optarg); break;
+      case 'u': options.upper = optarg; break;
+      case 'i': options.atomic = false; break;
+      case 's': options.system = true; break;
+      case 'x': options.binary = fs::absolute(optarg); break;
+      default: return 2;
+    }
+  }
+  bool keep = optind < argc;
+  options.dir = keep ? fs::absolute(argv[optind]) : fs::temp_directory_path() / ("chroot_venv_bench." + to_string(getpid()));
+  if (keep && fs::exists(options.dir)) {
+    cerr << options.dir << " already exists" << endl;
+    return 1;
+  }
+  if (!fs::exists(options.binary)) {
+    cerr << options.binary << " does not exist, pass it with -x" << endl;
+    return 1;
+  }
+
+  enterNamespaces();
+  buildTree(options);
+  cout
+    << options.layers << " layers, " << options.binds << " binds, " << options.tmpfs << " tmpfs, "
+    << options.upper << " upper, " << (options.atomic ? "atomic" : "in place") << " mount, "
+    << (options.system ? "" : "no ") << "system filesystems, "
+    << options.iterations << " iterations" << endl;
+
+  runRound(options, 1);
+  if (options.concurrency > 1) runRound(options, options.concurrency);
+
+  if (!keep) {
+    error_code ec;
+    fs::remove_all(options.dir, ec);
+  }
+  return 0;
+}
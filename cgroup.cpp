@@ -0,0 +1,117 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#include <linux/magic.h>
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string_view>
+
+#include "cgroup.hpp"
+
+using namespace std;
+namespace fs = filesystem;
+
+namespace chroot_venv {
+
+// Reads a small cgroup interface file from the start
+static string_view readAt(int fd, char *buf, size_t size) {
+  auto len = pread(fd, buf, size, 0);
+  return len > 0 ? string_view(buf, len) : string_view();
+}
+
+static bool isPopulated(string_view events) {
+  auto pos = events.find("populated ");
+  return pos == string_view::npos || events.substr(pos + 10, 1) != "0";
+}
+
+bool Cgroup::create(const fs::path &parent, const string &name) {
+  struct statfs st;
+  if (statfs(parent.c_str(), &st)) {
+    cerr << "Failed to stat cgroup parent " << parent << " " << strerror(errno) << endl;
+    return false;
+  }
+  if (st.f_type != CGROUP2_SUPER_MAGIC) {
+    cerr << parent << " is not on a cgroup2 filesystem" << endl;
+    return false;
+  }
+  auto path = parent / name;
+  if (verbose)
+    cerr << "mkdir(" << path << ")" << endl;
+  if (mkdir(path.c_str(), 0755)) {
+    cerr << "Failed to create cgroup " << path << " " << strerror(errno) << endl;
+    return false;
+  }
+  path_ = path;
+  procs_ = Fd(open((path / "cgroup.procs").c_str(), O_WRONLY | O_CLOEXEC));
+  if (!procs_) {
+    cerr << "Failed to open " << path / "cgroup.procs" << " " << strerror(errno) << endl;
+    rmdir(path.c_str());
+    path_.clear();
+    return false;
+  }
+  return true;
+}
+
+bool Cgroup::enter() const {
+  return write(procs_.get(), "0", 1) == 1;
+}
+
+// Before Linux 5.14 there is no cgroup.kill, so each member is signalled
+static void killMembers(const fs::path &path) {
+  ifstream procs(path / "cgroup.procs");
+  pid_t member;
+  while (procs >> member) kill(member, SIGKILL);
+}
+
+bool Cgroup::kill(int timeout_ms) const {
+  Fd events(open((path_ / "cgroup.events").c_str(), O_RDONLY | O_CLOEXEC));
+  if (!events) {
+    cerr << "Failed to open " << path_ / "cgroup.events" << " " << strerror(errno) << endl;
+    return false;
+  }
+  char buf[256];
+  if (!isPopulated(readAt(events.get(), buf, sizeof(buf)))) return true;
+
+  if (verbose)
+    cerr << "kill(" << path_ << ")" << endl;
+  Fd kill_fd(open((path_ / "cgroup.kill").c_str(), O_WRONLY | O_CLOEXEC));
+  bool killed = kill_fd && write(kill_fd.get(), "1", 1) == 1;
+
+  using clock = chrono::steady_clock;
+  auto deadline = clock::now() + chrono::milliseconds(timeout_ms);
+  while (isPopulated(readAt(events.get(), buf, sizeof(buf)))) {
+    // Members forked while signalling the others need another pass
+    if (!killed) killMembers(path_);
+    auto left = chrono::duration_cast<chrono::milliseconds>(deadline - clock::now()).count();
+    if (left <= 0) {
+      cerr << "Timed out waiting for cgroup " << path_ << " to empty" << endl;
+      return false;
+    }
+    // Changes to cgroup.events are signalled as POLLPRI
+    struct pollfd pfd = { events.get(), POLLPRI, 0 };
+    if (poll(&pfd, 1, left) < 0 && errno != EINTR) {
+      cerr << "Failed to poll " << path_ / "cgroup.events" << " " << strerror(errno) << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Cgroup::remove() {
+  if (path_.empty()) return true;
+  if (rmdir(path_.c_str()) && errno != ENOENT) {
+    cerr << "Failed to remove cgroup " << path_ << " " << strerror(errno) << endl;
+    return false;
+  }
+  procs_ = Fd();
+  path_.clear();
+  return true;
+}
+
+} // namespace
@@ -0,0 +1,36 @@
+#include <filesystem>
+#include <string>
+
+#include "mount.hpp"
+
+#pragma once
+
+namespace chroot_venv {
+
+// A cgroup v2 directory holding every process started for one invocation.
+// Processes cannot leave it by forking or calling chroot() again, so
+// teardown needs no scan of /proc: one write to cgroup.kill signals them
+// all and cgroup.events reports when the last one has gone.
+class Cgroup {
+  std::filesystem::path path_;
+  Fd procs_;
+
+public:
+  // Creates name below parent, which must be a directory on cgroup2
+  bool create(const std::filesystem::path &parent, const std::string &name);
+
+  // Moves the calling process into the cgroup. Only calls write(), so it is
+  // safe to use between fork() and exec.
+  bool enter() const;
+
+  // SIGKILLs every process in the cgroup and waits up to timeout_ms for it
+  // to become empty
+  bool kill(int timeout_ms) const;
+  // Removes the directory once the cgroup is empty
+  bool remove();
+
+  const std::filesystem::path &path() const { return path_; }
+  explicit operator bool() const { return !!procs_; }
+};
+
+} // namespace
@@ -1,57 +1,130 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <filesystem>
+#include <iostream>
+#include <thread>
 
 #include "config.hpp"
+#include "configcache.hpp"
+#include "layerstore.hpp"
 
 using namespace std;
 namespace fs = filesystem;
 
 namespace chroot_venv {
 
-string Config::optionsLower() const {
-  string options;
-  auto lowerCopy = lower;
-  if (base && fs::is_directory(*base)) {
-    lowerCopy.insert(lowerCopy.begin(), *base);
-  }
-  for (auto it = lowerCopy.rbegin(); it != lowerCopy.rend(); ++it) {
-    auto lowerStr = *it;
-    if (base) {
-      auto based = lowerStr + "." + *base;
-      if (fs::is_directory(based)) {
-        lowerStr = based;
-      }
-    }
-    if (fs::is_directory(lowerStr)) {
-      if (!options.empty()) options += ":";
-      options += lowerStr;
+// The digest of a sha256:<digest> reference, or nullopt if it is malformed
+static optional<string_view> layerDigest(string_view ref) {
+  ref.remove_prefix(strlen(LAYER_REF_PREFIX));
+  if (ref.size() != 64 || ref.find_first_not_of("0123456789abcdef") != string_view::npos) return nullopt;
+  return ref;
+}
+
+bool Config::validate(const fs::path &store) const {
+  bool valid = true;
+  auto fail = [&](const string &message) {
+    cerr << message << endl;
+    valid = false;
+  };
+  auto oneOf = [&](const optional<string> &value, const string &name, initializer_list<const char *> choices) {
+    if (!value) return;
+    for (auto choice : choices) {
+      if (*value == choice) return;
     }
+    fail("Invalid overlay " + name + " " + *value);
+  };
+  oneOf(overlay.xino, "xino", { "on", "off", "auto" });
+  oneOf(overlay.redirectdir, "redirect_dir", { "on", "follow", "nofollow", "off" });
+  if (overlay.nosync && noupper) fail("overlay volatile needs an upper layer");
+  // metacopy relies on redirects to find the data of a metacopy up, and
+  // creates them too with an upper layer
+  auto redirects = noupper ? overlay.redirectdir != "off" && overlay.redirectdir != "nofollow" : overlay.redirectdir.value_or("on") == "on";
+  if (overlay.metacopy.value_or(false) && !redirects) {
+    fail("overlay metacopy cannot be combined with redirect_dir " + *overlay.redirectdir);
+  }
+  if (indexoff && overlay.index.value_or(false)) fail("indexoff conflicts with overlay index");
+  // A missing layer would otherwise just drop out of the stack
+  for (auto &entry : lower) {
+    if (!entry.starts_with(LAYER_REF_PREFIX)) continue;
+    auto digest = layerDigest(entry);
+    error_code ec;
+    if (!digest) fail("Invalid layer reference " + entry);
+    else if (!fs::is_directory(store / *digest, ec)) fail("Layer " + entry + " is not in " + store.string());
   }
+  return valid;
+}
+
+vector<pair<string, string>> Config::overlayOptions() const {
+  vector<pair<string, string>> options;
+  auto onOff = [](bool on) { return on ? "on" : "off"; };
+  if (overlay.nosync) options.emplace_back("volatile", "");
+  if (overlay.metacopy) options.emplace_back("metacopy", onOff(*overlay.metacopy));
+  if (overlay.xino) options.emplace_back("xino", *overlay.xino);
+  if (overlay.redirectdir) options.emplace_back("redirect_dir", *overlay.redirectdir);
+  if (overlay.index) options.emplace_back("index", onOff(*overlay.index));
+  else if (indexoff) options.emplace_back("index", "off");
   return options;
 }
 
+vector<string> Config::resolveLower(const fs::path &store) const {
+  vector<string> dirs;
+  for (auto &entry : lower) {
+    if (!entry.starts_with(LAYER_REF_PREFIX)) {
+      dirs.push_back(entry);
+      continue;
+    }
+    // validate() has turned away malformed ones
+    if (auto digest = layerDigest(entry)) dirs.push_back(fs::absolute(store / *digest));
+  }
+  return dirs;
+}
+
 Config Config::loadFile(string build_file) {
   return YAML::LoadFile(build_file).as<Config>();
 }
 
-map<string, Config> Config::loadBuildRoots(string dir) {
+map<string, Config> Config::loadBuildRoots(string dir, ConfigCache *cache) {
   fs::path path(dir);
   map<string, Config> ret;
   if (!fs::is_directory(path))
     return ret;
-  for (auto p : fs::directory_iterator(path)) {
-    auto pp = p.path();
-    if (!fs::is_directory(pp))
-      continue;
-    pp /= ".buildroot.yaml";
-    if (!fs::is_regular_file(pp))
-      continue;
-    try {
-      ret[p.path()] = loadFile(pp);
-    } catch (exception &e) {
-      continue;
-    }
+  // The entry type comes from readdir(), so this needs no stat
+  vector<fs::path> roots;
+  for (auto &p : fs::directory_iterator(path)) {
+    error_code ec;
+    if (p.is_directory(ec)) roots.push_back(p.path());
   }
 
+  vector<optional<Config>> configs(roots.size());
+  vector<string> errors(roots.size());
+  atomic<size_t> next = 0;
+  auto worker = [&] {
+    for (size_t i; (i = next++) < roots.size();) {
+      auto file = roots[i] / ".buildroot.yaml";
+      error_code ec;
+      if (!fs::is_regular_file(file, ec))
+        continue;
+      try {
+        configs[i] = cache ? cache->load(file, file) : loadFile(file);
+      } catch (exception &e) {
+        errors[i] = e.what();
+      }
+    }
+  };
+  size_t threads = min<size_t>(max(thread::hardware_concurrency(), 1u), roots.size());
+  vector<thread> pool;
+  for (size_t i = 1; i < threads; ++i) pool.emplace_back(worker);
+  worker();
+  for (auto &t : pool) t.join();
+
+  for (size_t i = 0; i < roots.size(); ++i) {
+    if (configs[i]) {
+      ret[roots[i]] = move(*configs[i]);
+    } else if (!errors[i].empty()) {
+      cerr << "Failed to load " << roots[i] / ".buildroot.yaml" << " " << errors[i] << endl;
+    }
+  }
   return ret;
 }
 
@@ -59,6 +132,74 @@ map<string, Config> Config::loadBuildRoots(string dir) {
 
 namespace YAML {
 
+Node convert<chroot_venv::Bind>::encode(const chroot_venv::Bind& rhs) {
+  if (!rhs.hasOptions()) return Node(rhs.src);
+  Node node;
+  node["src"] = rhs.src;
+  if (rhs.recursive) node["recursive"] = rhs.recursive;
+  if (rhs.readonly) node["readonly"] = rhs.readonly;
+  if (rhs.nosuid) node["nosuid"] = rhs.nosuid;
+  if (rhs.nodev) node["nodev"] = rhs.nodev;
+  if (rhs.noexec) node["noexec"] = rhs.noexec;
+  return node;
+}
+
+bool convert<chroot_venv::Bind>::decode(const Node &node, chroot_venv::Bind& rhs) {
+  if (node.IsScalar()) {
+    rhs.src = node.as<string>();
+    return true;
+  }
+  if (!node.IsMap() || !node["src"]) return false;
+  rhs.src = node["src"].as<string>();
+  if (node["recursive"]) rhs.recursive = node["recursive"].as<bool>();
+  if (node["readonly"])  rhs.readonly = node["readonly"].as<bool>();
+  if (node["nosuid"])    rhs.nosuid = node["nosuid"].as<bool>();
+  if (node["nodev"])     rhs.nodev = node["nodev"].as<bool>();
+  if (node["noexec"])    rhs.noexec = node["noexec"].as<bool>();
+  return true;
+}
+
+Node convert<chroot_venv::OverlayOptions>::encode(const chroot_venv::OverlayOptions& rhs) {
+  Node node;
+  if (rhs.nosync)      node["volatile"] = rhs.nosync;
+  if (rhs.metacopy)    node["metacopy"] = *rhs.metacopy;
+  if (rhs.xino)        node["xino"] = *rhs.xino;
+  if (rhs.redirectdir) node["redirect_dir"] = *rhs.redirectdir;
+  if (rhs.index)       node["index"] = *rhs.index;
+  return node;
+}
+
+bool convert<chroot_venv::OverlayOptions>::decode(const Node &node, chroot_venv::OverlayOptions& rhs) {
+  if (!node.IsMap()) return false;
+  if (node["volatile"])     rhs.nosync = node["volatile"].as<bool>();
+  if (node["metacopy"])     rhs.metacopy = node["metacopy"].as<bool>();
+  if (node["xino"])         rhs.xino = node["xino"].as<string>();
+  if (node["redirect_dir"]) rhs.redirectdir = node["redirect_dir"].as<string>();
+  if (node["index"])        rhs.index = node["index"].as<bool>();
+  return true;
+}
+
+static const map<string, chroot_venv::UpperMode> UPPER_MODES = {
+  { "persistent", chroot_venv::UpperMode::PERSISTENT },
+  { "tmpfs", chroot_venv::UpperMode::TMPFS },
+  { "scratch", chroot_venv::UpperMode::SCRATCH },
+};
+
+Node convert<chroot_venv::UpperMode>::encode(const chroot_venv::UpperMode& rhs) {
+  for (auto &[name, mode] : UPPER_MODES) {
+    if (mode == rhs) return Node(name);
+  }
+  return Node();
+}
+
+bool convert<chroot_venv::UpperMode>::decode(const Node &node, chroot_venv::UpperMode& rhs) {
+  if (!node.IsScalar()) return false;
+  auto it = UPPER_MODES.find(node.Scalar());
+  if (it == UPPER_MODES.end()) return false;
+  rhs = it->second;
+  return true;
+}
+
 Node convert<chroot_venv::Config>::encode(const chroot_venv::Config& rhs) {
   Node node;
   if (rhs.base) node["base"] = *rhs.base;
@@ -67,10 +208,20 @@ Node convert<chroot_venv::Config>::encode(const chroot_venv::Config& rhs) {
   node["tmpfs"] = rhs.tmpfs;
   node["mktemp"] = rhs.mktemp;
   node["noupper"] = rhs.noupper;
+  if (!rhs.overlay.empty()) node["overlay"] = rhs.overlay;
+  node["upper"] = rhs.upper;
+  if (rhs.uppersize) node["uppersize"] = *rhs.uppersize;
   node["indexoff"] = rhs.indexoff;
   node["nosystem"] = rhs.nosystem;
   node["nochroot"] = rhs.nochroot;
   node["newnamespace"] = rhs.newnamespace;
+  node["atomicmount"] = rhs.atomicmount;
+  node["recursivesystem"] = rhs.recursivesystem;
+  node["lazyumount"] = rhs.lazyumount;
+  node["shared"] = rhs.shared;
+  node["linger"] = rhs.linger;
+  if (rhs.cgroup) node["cgroup"] = *rhs.cgroup;
+  node["killtimeout"] = rhs.killtimeout;
   node["cwd"] = rhs.cwd;
   if (rhs.shell.size() == 1) {
     node["shell"] = rhs.shell[0];
@@ -84,29 +235,45 @@ Node convert<chroot_venv::Config>::encode(const chroot_venv::Config& rhs) {
   return node;
 }
 
+// One pass over the map, rather than a search of it for every field
 bool convert<chroot_venv::Config>::decode(const Node &node, chroot_venv::Config& rhs) {
-  if (node["base"])     rhs.base = node["base"].as<string>();
-  if (node["lower"])    rhs.lower = node["lower"].as<vector<string>>();
-  if (node["binds"])    rhs.binds = node["binds"].as<map<string, string>>();
-  if (node["tmpfs"])    rhs.tmpfs = node["tmpfs"].as<vector<string>>();
-  if (node["mktemp"])   rhs.mktemp = node["mktemp"].as<bool>();
-  if (node["noupper"])  rhs.noupper = node["noupper"].as<bool>();
-  if (node["indexoff"])  rhs.indexoff = node["indexoff"].as<bool>();
-  if (node["nosystem"]) rhs.nosystem = node["nosystem"].as<bool>();
-  if (node["nochroot"]) rhs.nochroot = node["nochroot"].as<bool>();
-  if (node["newnamespace"]) rhs.newnamespace = node["newnamespace"].as<bool>();
-  if (node["cwd"])      rhs.cwd = node["cwd"].as<string>();
-  if (node["shell"]) {
-    auto shell = node["shell"];
-    if (shell.IsSequence()) {
-      rhs.shell = node["shell"].as<vector<string>>();
-    } else {
-      rhs.shell = vector<string> { node["shell"].as<string>() };
+  if (node.IsNull()) return true;
+  if (!node.IsMap()) return false;
+  for (auto field : node) {
+    auto &key = field.first.Scalar();
+    auto &value = field.second;
+    if (key == "base")             rhs.base = value.as<string>();
+    else if (key == "lower")       rhs.lower = value.as<vector<string>>();
+    else if (key == "binds")       rhs.binds = value.as<map<string, chroot_venv::Bind>>();
+    else if (key == "tmpfs")       rhs.tmpfs = value.as<vector<string>>();
+    else if (key == "mktemp")      rhs.mktemp = value.as<bool>();
+    else if (key == "noupper")     rhs.noupper = value.as<bool>();
+    else if (key == "overlay")     rhs.overlay = value.as<chroot_venv::OverlayOptions>();
+    else if (key == "upper")       rhs.upper = value.as<chroot_venv::UpperMode>();
+    else if (key == "uppersize")   rhs.uppersize = value.as<string>();
+    else if (key == "indexoff")    rhs.indexoff = value.as<bool>();
+    else if (key == "nosystem")    rhs.nosystem = value.as<bool>();
+    else if (key == "nochroot")    rhs.nochroot = value.as<bool>();
+    else if (key == "newnamespace") rhs.newnamespace = value.as<bool>();
+    else if (key == "atomicmount") rhs.atomicmount = value.as<bool>();
+    else if (key == "recursivesystem") rhs.recursivesystem = value.as<bool>();
+    else if (key == "lazyumount")  rhs.lazyumount = value.as<bool>();
+    else if (key == "shared")      rhs.shared = value.as<bool>();
+    else if (key == "linger")      rhs.linger = value.as<double>();
+    else if (key == "cgroup")      rhs.cgroup = value.as<string>();
+    else if (key == "killtimeout") rhs.killtimeout = value.as<double>();
+    else if (key == "cwd")         rhs.cwd = value.as<string>();
+    else if (key == "shell") {
+      if (value.IsSequence()) {
+        rhs.shell = value.as<vector<string>>();
+      } else {
+        rhs.shell = vector<string> { value.as<string>() };
+      }
     }
+    else if (key == "exec")        rhs.exec = value.as<string>();
+    else if (key == "args")        rhs.args = value.as<vector<string>>();
+    else if (key == "env")         rhs.env = value.as<map<string, string>>();
   }
-  if (node["exec"])     rhs.exec = node["exec"].as<string>();
-  if (node["args"])     rhs.args = node["args"].as<vector<string>>();
-  if (node["env"])      rhs.env = node["env"].as<map<string, string>>();
   return true;
 }
 
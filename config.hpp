@@ -13,33 +13,117 @@
 
 namespace chroot_venv {
 
+class ConfigCache;
+
+struct Bind {
+  std::string src;
+  // Clone the whole tree mounted below src rather than just its top mount
+  bool recursive = false;
+  bool readonly = false;
+  bool nosuid = false;
+  bool nodev = false;
+  bool noexec = false;
+
+  bool hasOptions() const { return recursive || readonly || nosuid || nodev || noexec; }
+};
+
+// Where the writable layer of the overlay lives
+enum class UpperMode {
+  // <root>.upper[.base] and .work next to the build root, kept between runs
+  PERSISTENT,
+  // On a tmpfs of the invocation, gone once the build root is unmounted
+  TMPFS,
+  // In a fresh <root>.scratch directory, deleted in the background after
+  SCRATCH,
+};
+
+// Overlayfs options, each left to the kernel default while unset
+struct OverlayOptions {
+  // The kernel's volatile: skip syncing the upper layer, which then does not
+  // survive a crash
+  bool nosync = false;
+  // Copy up only metadata on chmod and chown, and file data on first write
+  std::optional<bool> metacopy;
+  // on, off or auto
+  std::optional<std::string> xino;
+  // on, follow, nofollow or off
+  std::optional<std::string> redirectdir;
+  std::optional<bool> index;
+
+  bool empty() const { return !nosync && !metacopy && !xino && !redirectdir && !index; }
+};
+
 struct Config {
   std::optional<std::string> base;
   std::vector<std::string> lower;
-  std::map<std::string, std::string> binds;
+  std::map<std::string, Bind> binds;
   std::vector<std::string> tmpfs;
   bool mktemp = false;
   bool noupper = false;
+  OverlayOptions overlay;
+  UpperMode upper = UpperMode::PERSISTENT;
+  // tmpfs size= limit of a tmpfs upper, such as 2g or 50%
+  std::optional<std::string> uppersize;
   bool indexoff = false;
   bool nosystem = false;
   bool nochroot = false;
   bool newnamespace = false;
+  bool atomicmount = false;
+  bool recursivesystem = false;
+  bool lazyumount = false;
+  // Reuse the mounts of a running invocation, the last one out tears down
+  bool shared = false;
+  // Seconds a shared build root stays mounted after its last user exits
+  double linger = 0;
+  // cgroup2 directory to create a cgroup for each invocation in
+  std::optional<std::string> cgroup;
+  // Seconds between SIGTERM and SIGKILL when stopping processes
+  double killtimeout = 5;
   std::string cwd = "/";
   std::vector<std::string> shell = {"/bin/sh"};
   std::optional<std::string> exec;
   std::optional<std::vector<std::string>> args;
   std::map<std::string, std::string> env;
 
-  std::string optionsLower() const;
+  // Reports option combinations overlayfs would refuse to mount, and
+  // references to layers that are not in the store at store
+  bool validate(const std::filesystem::path &store = "layers.d") const;
+  // The overlay options as fsconfig() keys and values, where an empty value
+  // is a flag
+  std::vector<std::pair<std::string, std::string>> overlayOptions() const;
+
+  // lower with references to the layer store, sha256:<digest>, replaced by
+  // the directory of that layer in the store at store
+  std::vector<std::string> resolveLower(const std::filesystem::path &store = "layers.d") const;
 
   static Config loadFile(std::string buildFile);
-  static std::map<std::string, Config> loadBuildRoots(std::string dir);
+  // Loads the config of every build root below dir, several at once, and
+  // reports the ones that fail to parse
+  static std::map<std::string, Config> loadBuildRoots(std::string dir, ConfigCache *cache = nullptr);
 };
 
 } // namespace
 
 namespace YAML {
 
+template<>
+struct convert<chroot_venv::Bind> {
+  static Node encode(const chroot_venv::Bind& rhs);
+  static bool decode(const Node &node, chroot_venv::Bind& rhs);
+};
+
+template<>
+struct convert<chroot_venv::OverlayOptions> {
+  static Node encode(const chroot_venv::OverlayOptions& rhs);
+  static bool decode(const Node &node, chroot_venv::OverlayOptions& rhs);
+};
+
+template<>
+struct convert<chroot_venv::UpperMode> {
+  static Node encode(const chroot_venv::UpperMode& rhs);
+  static bool decode(const Node &node, chroot_venv::UpperMode& rhs);
+};
+
 template<>
 struct convert<chroot_venv::Config> {
   static Node encode(const chroot_venv::Config& rhs);
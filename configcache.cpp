@@ -0,0 +1,353 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <type_traits>
+
+#include "configcache.hpp"
+
+using namespace std;
+namespace fs = filesystem;
+
+namespace chroot_venv {
+
+// Bump whenever Config or the layout below changes
+static const char MAGIC[8] = { 'c', 'v', 'c', 'f', 'g', 0, 0, 4 };
+
+namespace {
+
+// Host-endian fixed-size values and length-prefixed containers. The cache is
+// never shared between machines.
+struct Writer {
+  string out;
+
+  template<typename T>
+  enable_if_t<is_arithmetic_v<T> || is_enum_v<T>> put(T value) {
+    out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+  void put(const string &str) {
+    put<uint64_t>(str.size());
+    out += str;
+  }
+  template<typename T>
+  void put(const optional<T> &opt) {
+    put(opt.has_value());
+    if (opt) put(*opt);
+  }
+  template<typename T>
+  void put(const vector<T> &vec) {
+    put<uint64_t>(vec.size());
+    for (auto &item : vec) put(item);
+  }
+  template<typename K, typename V>
+  void put(const map<K, V> &m) {
+    put<uint64_t>(m.size());
+    for (auto &[key, value] : m) {
+      put(key);
+      put(value);
+    }
+  }
+  void put(const Bind &bind) {
+    put(bind.src);
+    put(bind.recursive);
+    put(bind.readonly);
+    put(bind.nosuid);
+    put(bind.nodev);
+    put(bind.noexec);
+  }
+  void put(const OverlayOptions &overlay) {
+    put(overlay.nosync);
+    put(overlay.metacopy);
+    put(overlay.xino);
+    put(overlay.redirectdir);
+    put(overlay.index);
+  }
+  void put(const LayerPlan &plan) {
+    put(plan.layers);
+    put<uint64_t>(plan.stamps.size());
+    for (auto &stamp : plan.stamps) {
+      put(stamp.dir);
+      put(stamp.sec);
+      put(stamp.nsec);
+    }
+  }
+  void put(const Config &config) {
+    put(config.base);
+    put(config.lower);
+    put(config.binds);
+    put(config.tmpfs);
+    put(config.mktemp);
+    put(config.noupper);
+    put(config.overlay);
+    put(config.upper);
+    put(config.uppersize);
+    put(config.indexoff);
+    put(config.nosystem);
+    put(config.nochroot);
+    put(config.newnamespace);
+    put(config.atomicmount);
+    put(config.recursivesystem);
+    put(config.lazyumount);
+    put(config.shared);
+    put(config.linger);
+    put(config.cgroup);
+    put(config.killtimeout);
+    put(config.cwd);
+    put(config.shell);
+    put(config.exec);
+    put(config.args);
+    put(config.env);
+  }
+};
+
+// Mirrors Writer. Running past the end fails every later get().
+struct Reader {
+  const char *pos;
+  const char *end;
+
+  template<typename T>
+  enable_if_t<is_arithmetic_v<T> || is_enum_v<T>, bool> get(T &value) {
+    if ((size_t)(end - pos) < sizeof(value)) return false;
+    memcpy(&value, pos, sizeof(value));
+    pos += sizeof(value);
+    return true;
+  }
+  bool get(string &str) {
+    uint64_t size;
+    if (!get(size) || (uint64_t)(end - pos) < size) return false;
+    str.assign(pos, size);
+    pos += size;
+    return true;
+  }
+  template<typename T>
+  bool get(optional<T> &opt) {
+    bool present;
+    if (!get(present)) return false;
+    if (!present) {
+      opt.reset();
+      return true;
+    }
+    return get(opt.emplace());
+  }
+  template<typename T>
+  bool get(vector<T> &vec) {
+    uint64_t size;
+    if (!get(size) || size > (uint64_t)(end - pos)) return false;
+    vec.resize(size);
+    for (auto &item : vec) {
+      if (!get(item)) return false;
+    }
+    return true;
+  }
+  template<typename K, typename V>
+  bool get(map<K, V> &m) {
+    uint64_t size;
+    if (!get(size)) return false;
+    m.clear();
+    for (uint64_t i = 0; i < size; ++i) {
+      K key;
+      if (!get(key) || !get(m[key])) return false;
+    }
+    return true;
+  }
+  bool get(Bind &bind) {
+    return get(bind.src)
+      && get(bind.recursive)
+      && get(bind.readonly)
+      && get(bind.nosuid)
+      && get(bind.nodev)
+      && get(bind.noexec);
+  }
+  bool get(OverlayOptions &overlay) {
+    return get(overlay.nosync)
+      && get(overlay.metacopy)
+      && get(overlay.xino)
+      && get(overlay.redirectdir)
+      && get(overlay.index);
+  }
+  bool get(LayerPlan::Stamp &stamp) {
+    return get(stamp.dir) && get(stamp.sec) && get(stamp.nsec);
+  }
+  bool get(LayerPlan &plan) {
+    return get(plan.layers) && get(plan.stamps);
+  }
+  bool get(Config &config) {
+    return get(config.base)
+      && get(config.lower)
+      && get(config.binds)
+      && get(config.tmpfs)
+      && get(config.mktemp)
+      && get(config.noupper)
+      && get(config.overlay)
+      && get(config.upper)
+      && get(config.uppersize)
+      && get(config.indexoff)
+      && get(config.nosystem)
+      && get(config.nochroot)
+      && get(config.newnamespace)
+      && get(config.atomicmount)
+      && get(config.recursivesystem)
+      && get(config.lazyumount)
+      && get(config.shared)
+      && get(config.linger)
+      && get(config.cgroup)
+      && get(config.killtimeout)
+      && get(config.cwd)
+      && get(config.shell)
+      && get(config.exec)
+      && get(config.args)
+      && get(config.env);
+  }
+};
+
+} // namespace
+
+ConfigCache::ConfigCache(const fs::path &path) : path_(path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+  if (fd < 0) return;
+  struct stat st;
+  string data;
+  if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_uid == 0 && !(st.st_mode & (S_IWGRP | S_IWOTH))) {
+    data.resize(st.st_size);
+    if (read(fd, data.data(), data.size()) != (ssize_t)data.size()) data.clear();
+    // Written by a version that left env values readable to everyone, so
+    // the next save replaces it with a private one
+    dirty_ = st.st_mode & (S_IRGRP | S_IROTH);
+  } else {
+    cerr << "Ignoring config cache " << path << ", it is not a root-owned file writable only by root" << endl;
+  }
+  close(fd);
+
+  if (data.size() < sizeof(MAGIC) || memcmp(data.data(), MAGIC, sizeof(MAGIC))) return;
+  Reader in { data.data() + sizeof(MAGIC), data.data() + data.size() };
+  uint64_t count;
+  if (!in.get(count)) return;
+  for (uint64_t i = 0; i < count; ++i) {
+    string key;
+    Entry entry;
+    uint64_t dev, ino;
+    int64_t size;
+    if (!in.get(key) || !in.get(dev) || !in.get(ino) || !in.get(size)
+        || !in.get(entry.mtime_sec) || !in.get(entry.mtime_nsec) || !in.get(entry.config)) {
+      cerr << "Discarding corrupt config cache " << path << endl;
+      entries_.clear();
+      return;
+    }
+    entry.dev = dev;
+    entry.ino = ino;
+    entry.size = size;
+    entries_[key] = move(entry);
+  }
+  if (!in.get(plans_)) {
+    cerr << "Discarding corrupt config cache " << path << endl;
+    entries_.clear();
+    plans_.clear();
+  }
+}
+
+Config ConfigCache::load(const fs::path &key, const fs::path &file) {
+  struct stat st;
+  if (::stat(file.c_str(), &st)) return Config::loadFile(file);
+  {
+    lock_guard<mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      auto &entry = it->second;
+      if (entry.dev == st.st_dev && entry.ino == st.st_ino && entry.size == st.st_size
+          && entry.mtime_sec == st.st_mtim.tv_sec && entry.mtime_nsec == st.st_mtim.tv_nsec) {
+        return entry.config;
+      }
+    }
+  }
+
+  Entry entry;
+  entry.dev = st.st_dev;
+  entry.ino = st.st_ino;
+  entry.size = st.st_size;
+  entry.mtime_sec = st.st_mtim.tv_sec;
+  entry.mtime_nsec = st.st_mtim.tv_nsec;
+  entry.config = Config::loadFile(file);
+
+  lock_guard<mutex> lock(mutex_);
+  dirty_ = true;
+  auto &cached = entries_[key] = move(entry);
+  return cached.config;
+}
+
+// The inputs a plan is resolved from
+static string planKey(const Config &config) {
+  string key = config.base ? "+" + *config.base : "-";
+  for (auto &lower : config.lower) key += '\0' + lower;
+  return key;
+}
+
+LayerPlan ConfigCache::layers(const Config &config) {
+  auto key = planKey(config);
+  lock_guard<mutex> lock(mutex_);
+  auto it = plans_.find(key);
+  if (it != plans_.end() && it->second.current()) return it->second;
+
+  auto plan = LayerPlan::resolve(config.resolveLower(), config.base);
+  // A change within the same mtime tick as resolving would go unnoticed,
+  // so plans of directories changed just now are not kept
+  auto settled = time(nullptr) - 1;
+  if (all_of(plan.stamps.begin(), plan.stamps.end(), [&](auto &s) { return s.sec < settled; })) {
+    plans_[key] = plan;
+    dirty_ = true;
+  } else {
+    plans_.erase(key);
+  }
+  return plan;
+}
+
+bool ConfigCache::save() {
+  lock_guard<mutex> lock(mutex_);
+  if (!dirty_ || geteuid() != 0) return true;
+
+  Writer out;
+  out.out.append(MAGIC, sizeof(MAGIC));
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    if (fs::exists(it->first)) ++it;
+    else it = entries_.erase(it);
+  }
+  for (auto it = plans_.begin(); it != plans_.end();) {
+    if (it->second.current()) ++it;
+    else it = plans_.erase(it);
+  }
+  out.put<uint64_t>(entries_.size());
+  for (auto &[key, entry] : entries_) {
+    out.put(key);
+    out.put<uint64_t>(entry.dev);
+    out.put<uint64_t>(entry.ino);
+    out.put<int64_t>(entry.size);
+    out.put(entry.mtime_sec);
+    out.put(entry.mtime_nsec);
+    out.put(entry.config);
+  }
+  out.put(plans_);
+
+  // Replaced by rename(), so readers never see a partial cache
+  auto tmp = path_;
+  tmp += "." + to_string(getpid());
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, 0600);
+  if (fd < 0) {
+    cerr << "Failed to write config cache " << tmp << " " << strerror(errno) << endl;
+    return false;
+  }
+  bool written = write(fd, out.out.data(), out.out.size()) == (ssize_t)out.out.size();
+  written = !close(fd) && written;
+  if (!written || rename(tmp.c_str(), path_.c_str())) {
+    cerr << "Failed to write config cache " << path_ << " " << strerror(errno) << endl;
+    unlink(tmp.c_str());
+    return false;
+  }
+  dirty_ = false;
+  return true;
+}
+
+} // namespace
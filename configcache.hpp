@@ -0,0 +1,57 @@
+#include <sys/types.h>
+
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "config.hpp"
+#include "layers.hpp"
+
+#pragma once
+
+namespace chroot_venv {
+
+// Decoded Configs kept in one binary file, so a build root's YAML is only
+// parsed again once its .buildroot.yaml changes. Entries are keyed by the
+// config's path together with the device, inode, mtime and size it had when
+// decoded. The file is only trusted when it is owned by root and writable
+// by nobody else, and only written when running as root.
+//
+// It also keeps the LayerPlan resolved for each lower stack and base.
+class ConfigCache {
+  struct Entry {
+    dev_t dev = 0;
+    ino_t ino = 0;
+    off_t size = 0;
+    int64_t mtime_sec = 0;
+    int64_t mtime_nsec = 0;
+    Config config;
+  };
+
+  std::filesystem::path path_;
+  std::map<std::string, Entry> entries_;
+  std::map<std::string, LayerPlan> plans_;
+  bool dirty_ = false;
+  mutable std::mutex mutex_;
+
+public:
+  // Reads the cache at path, starting out empty if it is missing, untrusted
+  // or from another version
+  explicit ConfigCache(const std::filesystem::path &path);
+
+  // Config::loadFile() of file, cached under key. key names the config for
+  // when file is reached through another path, such as /proc/self/fd.
+  // Throws like Config::loadFile(). Safe to call from several threads.
+  Config load(const std::filesystem::path &key, const std::filesystem::path &file);
+
+  // The layers of config, resolved again once a directory they were
+  // resolved from has changed
+  LayerPlan layers(const Config &config);
+
+  // Writes the cache back if anything was resolved or decoded, dropping
+  // entries whose config is gone and plans that are out of date
+  bool save();
+};
+
+} // namespace
@@ -0,0 +1,81 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <iostream>
+
+#include "fds.hpp"
+
+using namespace std;
+
+namespace chroot_venv {
+
+static optional<int> parseFd(string_view str) {
+  int fd;
+  auto [end, ec] = from_chars(str.data(), str.data() + str.size(), fd);
+  if (ec != errc() || end != str.data() + str.size() || fd < 0) return nullopt;
+  return fd;
+}
+
+optional<pair<int, int>> parseKeepFd(const string &spec) {
+  auto colon = spec.find(':');
+  auto src = parseFd(string_view(spec).substr(0, colon));
+  if (!src) return nullopt;
+  if (colon == string::npos) return make_pair(*src, *src);
+  auto dst = parseFd(string_view(spec).substr(colon + 1));
+  if (!dst) return nullopt;
+  return make_pair(*dst, *src);
+}
+
+// Kernels before 5.9 lack close_range(), close one at a time there
+static void closeRange(unsigned int first, unsigned int last) {
+  if (!close_range(first, last, 0) || errno != ENOSYS) return;
+  long limit = sysconf(_SC_OPEN_MAX);
+  for (long fd = first; fd < limit && fd <= (long)last; ++fd) close(fd);
+}
+
+bool inheritFds(const TFdMap &fds) {
+  // Park every remapped src above all numbers involved first, so a dst can
+  // be another entry's src
+  int floor = 3;
+  for (auto &[dst, src] : fds) floor = max({ floor, dst + 1, src + 1 });
+  TFdMap parked;
+  for (auto &[dst, src] : fds) {
+    if (dst == src) {
+      // Kept in place, but it has to survive exec
+      if (fcntl(dst, F_SETFD, 0)) {
+        cerr << "Failed to keep fd " << dst << " " << strerror(errno) << endl;
+        return false;
+      }
+      continue;
+    }
+    int fd = fcntl(src, F_DUPFD_CLOEXEC, floor);
+    if (fd < 0) {
+      cerr << "Failed to duplicate fd " << src << " " << strerror(errno) << endl;
+      return false;
+    }
+    parked[dst] = fd;
+  }
+  for (auto &[dst, fd] : parked) {
+    // dup3() leaves dst without FD_CLOEXEC
+    if (dup3(fd, dst, 0) < 0) {
+      cerr << "Failed to move fd to " << dst << " " << strerror(errno) << endl;
+      return false;
+    }
+  }
+
+  unsigned int next = 3;
+  for (auto &[dst, src] : fds) {
+    if (dst < (int)next) continue;
+    if (dst > (int)next) closeRange(next, dst - 1);
+    next = dst + 1;
+  }
+  // Also closes the parked copies
+  closeRange(next, UINT_MAX);
+  return true;
+}
+
+} // namespace
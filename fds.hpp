@@ -0,0 +1,22 @@
+#include <map>
+#include <optional>
+#include <string>
+#include <utility>
+
+#pragma once
+
+namespace chroot_venv {
+
+// The fds an exec'd program inherits, keyed by the number it sees them at
+// and mapping to the fd they are copied from
+using TFdMap = std::map<int, int>;
+
+// Parses a --keepfd argument, either "fd" or "src:dst", into { dst, src }
+std::optional<std::pair<int, int>> parseKeepFd(const std::string &spec);
+
+// Moves every src onto its dst with dup3() and closes all other fds above
+// stderr, using one close_range() per gap between kept fds. For the forked
+// child right before exec.
+bool inheritFds(const TFdMap &fds);
+
+} // namespace
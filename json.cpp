@@ -0,0 +1,30 @@
+#include <stdio.h>
+
+#include "json.hpp"
+
+using namespace std;
+
+namespace chroot_venv {
+
+void writeJsonString(ostream &os, const string &str) {
+  os << '"';
+  for (unsigned char c : str) {
+    switch (c) {
+      case '"': os << "\\\""; break;
+      case '\\': os << "\\\\"; break;
+      case '\n': os << "\\n"; break;
+      case '\t': os << "\\t"; break;
+      default:
+        if (c < 0x20) {
+          char escaped[7];
+          snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+          os << escaped;
+        } else {
+          os << c;
+        }
+    }
+  }
+  os << '"';
+}
+
+} // namespace
@@ -0,0 +1,11 @@
+#include <ostream>
+#include <string>
+
+#pragma once
+
+namespace chroot_venv {
+
+// Writes str as a quoted JSON string
+void writeJsonString(std::ostream &os, const std::string &str);
+
+} // namespace
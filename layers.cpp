@@ -0,0 +1,66 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <filesystem>
+#include <set>
+
+#include "layers.hpp"
+
+using namespace std;
+namespace fs = filesystem;
+
+namespace chroot_venv {
+
+static bool isDirectory(const string &path) {
+  struct statx stx;
+  if (statx(AT_FDCWD, path.c_str(), 0, STATX_TYPE, &stx)) return false;
+  return S_ISDIR(stx.stx_mode);
+}
+
+// A missing directory is stamped too, in case it turns up later
+static LayerPlan::Stamp stamp(const string &dir) {
+  struct statx stx;
+  if (statx(AT_FDCWD, dir.c_str(), 0, STATX_MTIME, &stx)) return { dir, -1, 0 };
+  return { dir, stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec };
+}
+
+LayerPlan LayerPlan::resolve(const vector<string> &lower, const optional<string> &base) {
+  LayerPlan plan;
+  vector<string> stack;
+  if (base) stack.push_back(*base);
+  stack.insert(stack.end(), lower.begin(), lower.end());
+
+  // Creating or removing a candidate, or its base variant, changes the
+  // mtime of the directory holding it
+  set<string> parents;
+  for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+    auto parent = fs::path(*it).parent_path().string();
+    parents.insert(parent.empty() ? "." : parent);
+    if (base && isDirectory(*it + "." + *base)) {
+      plan.layers.push_back(*it + "." + *base);
+    } else if (isDirectory(*it)) {
+      plan.layers.push_back(*it);
+    }
+  }
+  for (auto &parent : parents) plan.stamps.push_back(stamp(parent));
+  return plan;
+}
+
+bool LayerPlan::current() const {
+  for (auto &s : stamps) {
+    auto now = stamp(s.dir);
+    if (now.sec != s.sec || now.nsec != s.nsec) return false;
+  }
+  return true;
+}
+
+string LayerPlan::lowerdir() const {
+  string options;
+  for (auto &layer : layers) {
+    if (!options.empty()) options += ":";
+    options += layer;
+  }
+  return options;
+}
+
+} // namespace
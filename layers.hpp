@@ -0,0 +1,37 @@
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#pragma once
+
+namespace chroot_venv {
+
+// The lower directories of an overlay, resolved from a config's lower list
+// and base. Along with the layers it keeps the mtime of every directory
+// whose entries decided them, so it can be reused until one of those
+// changes.
+struct LayerPlan {
+  struct Stamp {
+    std::string dir;
+    int64_t sec = 0;
+    uint32_t nsec = 0;
+  };
+
+  // Top layer first, the order overlayfs takes them in
+  std::vector<std::string> layers;
+  std::vector<Stamp> stamps;
+
+  // Stacks lower on top of base, taking <dir>.<base> over <dir> where it
+  // exists and skipping entries that are not directories. One statx() per
+  // candidate and per parent directory.
+  static LayerPlan resolve(const std::vector<std::string> &lower, const std::optional<std::string> &base);
+
+  // Whether every stamped directory still has the same mtime
+  bool current() const;
+
+  // The layers joined for a single lowerdir= option
+  std::string lowerdir() const;
+};
+
+} // namespace
@@ -0,0 +1,368 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "layerstore.hpp"
+#include "mount.hpp"
+
+using namespace std;
+namespace fs = filesystem;
+
+namespace chroot_venv {
+
+namespace {
+
+using TXattrs = vector<pair<string, string>>;
+
+// Sorted, so they hash the same whatever order the filesystem lists them in
+optional<TXattrs> readXattrs(int fd) {
+  TXattrs xattrs;
+  auto size = flistxattr(fd, nullptr, 0);
+  if (size < 0) {
+    if (errno == ENOTSUP) return xattrs;
+    return nullopt;
+  }
+  string names(size, '\0');
+  size = flistxattr(fd, names.data(), names.size());
+  if (size < 0) return nullopt;
+  for (size_t pos = 0; pos < (size_t)size; pos += strlen(&names[pos]) + 1) {
+    string name = &names[pos];
+    auto len = fgetxattr(fd, name.c_str(), nullptr, 0);
+    if (len < 0) return nullopt;
+    string value(len, '\0');
+    len = fgetxattr(fd, name.c_str(), value.data(), value.size());
+    if (len < 0) return nullopt;
+    value.resize(len);
+    xattrs.emplace_back(move(name), move(value));
+  }
+  sort(xattrs.begin(), xattrs.end());
+  return xattrs;
+}
+
+// Opens rel of the source without following a symlink at any level, so
+// one planted in it cannot lead the import out of the tree
+Fd openSource(int root, const string &rel, int flags) {
+  struct open_how how = {};
+  how.flags = flags | O_NOFOLLOW | O_CLOEXEC;
+  how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+  return Fd(syscall(SYS_openat2, root, rel.c_str(), &how, sizeof(how)));
+}
+
+// Owner before mode, as chown() clears the set-id bits
+bool applyMetadata(int fd, const struct stat &st, const TXattrs &xattrs) {
+  if (fchown(fd, st.st_uid, st.st_gid) || fchmod(fd, st.st_mode & 07777)) return false;
+  for (auto &[name, value] : xattrs) {
+    if (fsetxattr(fd, name.c_str(), value.data(), value.size(), 0)) return false;
+  }
+  return true;
+}
+
+// What a file is stored under besides its content
+string describe(const struct stat &st, const TXattrs &xattrs) {
+  string desc = to_string(st.st_mode) + " " + to_string(st.st_uid) + " " + to_string(st.st_gid);
+  for (auto &[name, value] : xattrs) {
+    desc += '\0' + name + '=' + value;
+  }
+  return desc;
+}
+
+class Sha256 {
+  unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx_;
+
+public:
+  Sha256() : ctx_(EVP_MD_CTX_new(), EVP_MD_CTX_free) {
+    EVP_DigestInit_ex(ctx_.get(), EVP_sha256(), nullptr);
+  }
+
+  void update(const void *data, size_t size) {
+    EVP_DigestUpdate(ctx_.get(), data, size);
+  }
+  void update(const string &str) {
+    // Keeps "a" "bc" apart from "ab" "c"
+    update(str.data(), str.size() + 1);
+  }
+
+  string hex() {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int size = 0;
+    EVP_DigestFinal_ex(ctx_.get(), digest, &size);
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    for (unsigned int i = 0; i < size; ++i) {
+      hex += digits[digest[i] >> 4];
+      hex += digits[digest[i] & 15];
+    }
+    return hex;
+  }
+};
+
+// Fills dst with the content of src, sharing extents where the filesystem
+// can
+bool cloneContent(int src, int dst, off_t size) {
+  if (!ioctl(dst, FICLONE, src)) return true;
+  while (size > 0) {
+    auto n = copy_file_range(src, nullptr, dst, nullptr, size, 0);
+    if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS)) {
+      n = sendfile(dst, src, nullptr, size);
+    }
+    if (n < 0) return false;
+    if (!n) break;
+    size -= n;
+  }
+  return true;
+}
+
+struct File {
+  string rel;
+  struct stat st;
+  // Set once stored, for the listing
+  string digest;
+};
+
+class Import {
+  fs::path store_;
+  Fd src_;
+  Fd objects_;
+  Fd layer_;
+  fs::path layer_path_;
+
+  vector<string> listing_;
+  vector<File> files_;
+  vector<pair<string, array<struct timespec, 2>>> dir_times_;
+
+  atomic<size_t> next_ = 0;
+  atomic<bool> failed_ = false;
+  atomic<size_t> stored_ = 0;
+  atomic<size_t> linked_ = 0;
+  mutex tmp_mutex_;
+  size_t tmp_count_ = 0;
+
+  bool fail(const string &what, const string &rel) {
+    cerr << "Failed to " << what << " " << rel << " " << strerror(errno) << endl;
+    return false;
+  }
+
+  // Recreates the directory rel of the source in the layer, recursing into
+  // it and leaving regular files for the workers
+  bool walk(const string &rel) {
+    Fd dirfd(openSource(src_.get(), rel, O_RDONLY | O_DIRECTORY));
+    if (!dirfd) return fail("open", rel);
+    struct stat st;
+    auto xattrs = readXattrs(dirfd.get());
+    if (fstat(dirfd.get(), &st) || !xattrs) return fail("stat", rel);
+    if (rel != "." && mkdirat(layer_.get(), rel.c_str(), 0700)) return fail("create", rel);
+    Fd out(openat(layer_.get(), rel.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    if (!out || !applyMetadata(out.get(), st, *xattrs)) return fail("set up", rel);
+    listing_.push_back("d " + rel + " " + describe(st, *xattrs));
+    dir_times_.push_back({ rel, { st.st_atim, st.st_mtim } });
+
+    DIR *dir = fdopendir(dup(dirfd.get()));
+    if (!dir) return fail("read", rel);
+    vector<string> subdirs;
+    bool ok = true;
+    while (auto ent = readdir(dir)) {
+      string name = ent->d_name;
+      if (name == "." || name == "..") continue;
+      auto path = rel == "." ? name : rel + "/" + name;
+      struct stat est;
+      if (fstatat(dirfd.get(), name.c_str(), &est, AT_SYMLINK_NOFOLLOW)) {
+        ok = fail("stat", path);
+        break;
+      }
+      if (S_ISDIR(est.st_mode)) {
+        subdirs.push_back(path);
+      } else if (S_ISREG(est.st_mode)) {
+        files_.push_back({ path, est, {} });
+      } else if (S_ISLNK(est.st_mode)) {
+        string target(est.st_size + 1, '\0');
+        auto len = readlinkat(dirfd.get(), name.c_str(), target.data(), target.size());
+        if (len < 0) {
+          ok = fail("read", path);
+          break;
+        }
+        target.resize(len);
+        if (symlinkat(target.c_str(), out.get(), name.c_str())
+            || fchownat(out.get(), name.c_str(), est.st_uid, est.st_gid, AT_SYMLINK_NOFOLLOW)) {
+          ok = fail("create", path);
+          break;
+        }
+        listing_.push_back("l " + path + " " + to_string(est.st_uid) + " " + to_string(est.st_gid) + " " + target);
+      } else {
+        // Devices, fifos, sockets and whiteouts
+        if (mknodat(out.get(), name.c_str(), est.st_mode, est.st_rdev)
+            || fchownat(out.get(), name.c_str(), est.st_uid, est.st_gid, AT_SYMLINK_NOFOLLOW)
+            || fchmodat(out.get(), name.c_str(), est.st_mode & 07777, 0)) {
+          ok = fail("create", path);
+          break;
+        }
+        listing_.push_back("n " + path + " " + describe(est, {}) + " " + to_string(est.st_rdev));
+      }
+    }
+    closedir(dir);
+    if (!ok) return false;
+    for (auto &sub : subdirs) {
+      if (!walk(sub)) return false;
+    }
+    return true;
+  }
+
+  // Hashes a file, adds it to the objects unless it is already there and
+  // links it into the layer
+  bool store(File &file) {
+    Fd fd(openSource(src_.get(), file.rel, O_RDONLY));
+    if (!fd) return fail("open", file.rel);
+    auto xattrs = readXattrs(fd.get());
+    if (!xattrs) return fail("read xattrs of", file.rel);
+
+    Sha256 sha;
+    sha.update(describe(file.st, *xattrs));
+    vector<char> buf(1 << 20);
+    ssize_t n;
+    while ((n = read(fd.get(), buf.data(), buf.size())) > 0) sha.update(buf.data(), n);
+    if (n < 0) return fail("read", file.rel);
+    file.digest = sha.hex();
+
+    auto object = file.digest.substr(0, 2) + "/" + file.digest.substr(2);
+    if (mkdirat(objects_.get(), file.digest.substr(0, 2).c_str(), 0700) && errno != EEXIST) {
+      return fail("create object dir for", file.rel);
+    }
+    if (faccessat(objects_.get(), object.c_str(), F_OK, AT_SYMLINK_NOFOLLOW)) {
+      string tmp;
+      {
+        lock_guard<mutex> lock(tmp_mutex_);
+        tmp = "tmp." + to_string(getpid()) + "." + to_string(tmp_count_++);
+      }
+      Fd out(openat(objects_.get(), tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600));
+      struct timespec times[2] = { file.st.st_atim, file.st.st_mtim };
+      if (!out || lseek(fd.get(), 0, SEEK_SET)
+          || !cloneContent(fd.get(), out.get(), file.st.st_size)
+          || !applyMetadata(out.get(), file.st, *xattrs)
+          || futimens(out.get(), times)) {
+        unlinkat(objects_.get(), tmp.c_str(), 0);
+        return fail("store", file.rel);
+      }
+      // Another import may have stored it meanwhile, keep the first
+      if (linkat(objects_.get(), tmp.c_str(), objects_.get(), object.c_str(), 0) && errno != EEXIST) {
+        unlinkat(objects_.get(), tmp.c_str(), 0);
+        return fail("store", file.rel);
+      }
+      unlinkat(objects_.get(), tmp.c_str(), 0);
+      ++stored_;
+    } else {
+      ++linked_;
+    }
+
+    if (!linkat(objects_.get(), object.c_str(), layer_.get(), file.rel.c_str(), 0)) return true;
+    if (errno != EMLINK) return fail("link", file.rel);
+    // Out of links on this object, give the layer its own copy
+    Fd obj(openat(objects_.get(), object.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+    Fd out(openat(layer_.get(), file.rel.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600));
+    struct timespec times[2] = { file.st.st_atim, file.st.st_mtim };
+    if (!obj || !out
+        || !cloneContent(obj.get(), out.get(), file.st.st_size)
+        || !applyMetadata(out.get(), file.st, *xattrs)
+        || futimens(out.get(), times)) {
+      return fail("copy", file.rel);
+    }
+    return true;
+  }
+
+  void worker() {
+    for (size_t i; !failed_ && (i = next_++) < files_.size();) {
+      if (!store(files_[i])) failed_ = true;
+    }
+  }
+
+public:
+  optional<string> run(const fs::path &store, const fs::path &src, unsigned threads) {
+    store_ = store;
+    src_ = Fd(open(src.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (!src_) {
+      fail("open", src);
+      return nullopt;
+    }
+    for (auto &dir : { store, store / "objects" }) {
+      if (mkdir(dir.c_str(), 0700) && errno != EEXIST) {
+        fail("create", dir);
+        return nullopt;
+      }
+    }
+    objects_ = Fd(open((store / "objects").c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    layer_path_ = store / ("tmp." + to_string(getpid()));
+    if (!objects_ || mkdir(layer_path_.c_str(), 0700)) {
+      fail("create", layer_path_);
+      return nullopt;
+    }
+    layer_ = Fd(open(layer_path_.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    if (!layer_ || !walk(".")) return nullopt;
+
+    vector<thread> pool;
+    for (unsigned i = 1; i < max(threads, 1u); ++i) pool.emplace_back(&Import::worker, this);
+    worker();
+    for (auto &t : pool) t.join();
+    if (failed_) return nullopt;
+
+    // Directory times last, linking files in changed them
+    for (auto &[rel, times] : dir_times_) {
+      if (utimensat(layer_.get(), rel.c_str(), times.data(), AT_SYMLINK_NOFOLLOW)) {
+        fail("set times of", rel);
+        return nullopt;
+      }
+    }
+
+    for (auto &file : files_) listing_.push_back("f " + file.rel + " " + file.digest);
+    sort(listing_.begin(), listing_.end());
+    Sha256 sha;
+    for (auto &line : listing_) sha.update(line);
+    auto digest = sha.hex();
+
+    auto layer = store / digest;
+    if (rename(layer_path_.c_str(), layer.c_str())) {
+      if (errno != EEXIST && errno != ENOTEMPTY) {
+        fail("create", layer);
+        return nullopt;
+      }
+      cerr << "Layer " << digest << " is already stored" << endl;
+      fs::remove_all(layer_path_);
+    }
+    cerr
+      << "Stored " << src << " as " << layer << ": "
+      << stored_ << " new files, " << linked_ << " already stored" << endl;
+    return LAYER_REF_PREFIX + digest;
+  }
+
+  ~Import() {
+    if (!layer_path_.empty()) {
+      error_code ec;
+      fs::remove_all(layer_path_, ec);
+    }
+  }
+};
+
+} // namespace
+
+optional<string> LayerStore::import(const fs::path &src, unsigned threads) {
+  return Import().run(dir_, src, threads);
+}
+
+} // namespace
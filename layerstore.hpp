@@ -0,0 +1,32 @@
+#include <filesystem>
+#include <optional>
+#include <string>
+
+#pragma once
+
+namespace chroot_venv {
+
+// Lower entries of this form name a layer in the layer store
+const char LAYER_REF_PREFIX[] = "sha256:";
+
+// A content-addressed store of lower layers, each a directory named by the
+// sha256 of its listing so the same tree is only ever stored once. Regular
+// files are kept once under objects/, named by the sha256 of their mode,
+// owner, xattrs and content, and every layer holding one is a hardlink to
+// it. Identical files of different layers share one inode, and with it one
+// copy in the page cache. Times of a shared file are those of its first
+// copy stored. The store is only accessible to root, which overlayfs uses
+// to read lower layers on behalf of the chroot.
+class LayerStore {
+  std::filesystem::path dir_;
+
+public:
+  explicit LayerStore(std::filesystem::path dir) : dir_(std::move(dir)) {}
+
+  // Imports the tree at src as a layer, linking files that are already
+  // stored and cloning or copying the rest in, on up to threads threads.
+  // Returns the reference to the layer for a lower entry.
+  std::optional<std::string> import(const std::filesystem::path &src, unsigned threads);
+};
+
+} // namespace
@@ -1,7 +1,6 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <string.h>
-#include <sys/file.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -9,7 +8,9 @@
 #include <unistd.h>
 #include <sched.h>
 
+#include <algorithm>
 #include <array>
+#include <chrono>
 #include <csignal>
 #include <cstdlib>
 #include <deque>
@@ -20,14 +21,27 @@
 #include <mutex>
 #include <optional>
 #include <string>
+#include <thread>
 #include <tuple>
-#include <unordered_set>
 #include <vector>
 
 #include <docopt/docopt.h>
 
+#include "batch.hpp"
+#include "cgroup.hpp"
 #include "config.hpp"
+#include "configcache.hpp"
+#include "fds.hpp"
+#include "layers.hpp"
+#include "layerstore.hpp"
+#include "mount.hpp"
 #include "procmounts.hpp"
+#include "squash.hpp"
+#include "statestore.hpp"
+#include "supervisor.hpp"
+#include "trace.hpp"
+#include "trash.hpp"
+#include "zygote.hpp"
 
 using namespace std;
 namespace fs = std::filesystem;
@@ -41,12 +55,25 @@ R"(chroot virtual environment manager.
 
     Usage:
       chroot_venv [options] [--keepfd=<fd>]... <chroot-name> [<command-or-args> ...]
+      chroot_venv [options] --batch=<manifest>
+      chroot_venv [options] --squash=<layer> <chroot-name>
+      chroot_venv [options] --store=<dir>
       chroot_venv (-h | --help)
 
     Options:
-      -f <fd> --keepfd=<fd>    Keep FD open
+      -f <fd> --keepfd=<fd>    Keep FD open, or move it with src:dst
       -b <base> --base=<base>  Set or override base image
       -p --print               Print build_root yaml
+      -d --daemon              Keep the chroot mounted and serve commands on <chroot-name>.sock
+      -c --connect             Run the command through the daemon serving <chroot-name>, in the
+                               current directory if it exists inside the chroot, else in its cwd
+      --batch=<manifest>       Run the jobs of a YAML or JSON lines manifest, printing
+                               a line of JSON for each as it finishes
+      -j <n> --jobs=<n>        Run at most n batch jobs or squash threads at once, one per CPU by default
+      --squash=<layer>         Merge the lower layers of <chroot-name> into the new directory <layer>
+      --store=<dir>            Add the tree at <dir> to the layer store and print its lower entry
+      --trace=<file>           Write the timings of each stage, mount and child as a Chrome trace,
+                               or append them as JSON lines if <file> ends in .jsonl
       -v --verbose             Print verbose messages
       -h --help                Show this screen.
 )";
@@ -60,56 +87,38 @@ const array<const string, 4> SYSTEM_FS = {
   "/dev/pts",
 };
 
-class FileLock {
-  int fd_;
-public:
-  FileLock(int fd) : fd_(fd) {};
-
-  void lock() {
-    if (flock(fd_, LOCK_EX)) {
-      cerr << "Failed to lock " << fd_ << endl;
-      throw exception();
-    }
-  }
-
-  void unlock() {
-    flock(fd_, LOCK_UN);
-  }
-};
-
-int mount(string src, string dst, string fs, int flags, string opts) {
-  if (verbose)
-    cerr << "mount(" << src << ", " << dst << ", " << fs << ", " << flags << ", " << opts << ")" << endl;
-  return ::mount(src.c_str(), dst.c_str(), fs.c_str(), flags, opts.c_str());
-}
-
-int umount(string dst) {
-  if (verbose)
-    cerr << "umount(" << dst << ")" << endl;
-  return ::umount(dst.c_str());
-}
+// Owns the signal mask, which is per process
+Supervisor supervisor;
 
 struct State {
-  State(fs::path root): build_root(root), build_root_orig(root) {}
+  State(fs::path root): build_root(root), build_root_orig(root), instance(to_string(getpid())) {}
   fs::path build_root;
   const fs::path build_root_orig;
-  deque<fs::path> mounted_system_fs;
-  vector<fs::path> mounted_binds;
-  vector<fs::path> mounted_tmpfs;
-  unordered_set<int> keepfd;
-  int mtabLockFd = -1;
-  shared_ptr<FileLock> mtabLock;
+  // Tells apart the cgroups of build roots set up by one process
+  string instance;
+  LayerPlan layers;
+  Cgroup cgroup;
+  // A shared build root that other invocations still use
+  bool keep_mounts = false;
+  // Set in the process lingering on a shared build root, to the record's
+  // lingers it left
+  unsigned lingers = 0;
+  bool daemon = false;
+  TFdMap keepfd;
+  optional<StateEntry> entry;
   int exitstatus = 0;
 };
-int pid = -1;
 
-bool halting = false;
+// Where the daemon for a build root listens
+fs::path socketPath(const State &state) {
+  auto path = state.build_root_orig;
+  path += ".sock";
+  return path;
+}
 
-void signalHandler(int signum) {
-  cerr << "Interrupt signal (" << signum << ") received." << endl;
-  if (halting) return;
-  if (pid > 1) kill(pid, signum);
-  halting = true;
+// Grace period between SIGTERM and SIGKILL
+chrono::milliseconds killTimeout(const Config &config) {
+  return chrono::duration_cast<chrono::milliseconds>(chrono::duration<double>(config.killtimeout));
 }
 
 enum class Stage {
@@ -123,146 +132,91 @@ enum class Stage {
   MTAB,
 };
 
-optional<Stage> start(deque<string> args, const Config &config, shared_ptr<State> state) {
-  state->mtabLockFd = open("mtab", O_CREAT | O_RDONLY | O_CLOEXEC, 00664);
-  if (state->mtabLockFd < 0) {
-    cerr << "Failed to open lock file" << endl;
-    return Stage::NONE;
-  }
-  state->mtabLock = make_shared<FileLock>(state->mtabLockFd);
-  if (!state->mtabLock) {
-    cerr << "Failed to create FileLock" << endl;
-    return Stage::NONE;
+// With recursivesystem, entries below an earlier one come along with its clone
+bool clonedWithParent(const string &fs) {
+  for (auto &parent : SYSTEM_FS) {
+    if (parent == fs) return false;
+    if (fs.starts_with(parent + "/")) return true;
   }
+  return false;
+}
 
-  if (config.mktemp) {
-    string tmp = "/tmp/chroot-XXXXXX";
-    if (! mkdtemp(tmp.data())) {
-      cerr << "Failed to create temp dir" << endl;
-      return Stage::NONE;
-    }
-    state->build_root = tmp;
-  }
+uint64_t bindAttr(const Bind &bind) {
+  return
+    (bind.readonly ? MOUNT_ATTR_RDONLY : 0) |
+    (bind.nosuid ? MOUNT_ATTR_NOSUID : 0) |
+    (bind.nodev ? MOUNT_ATTR_NODEV : 0) |
+    (bind.noexec ? MOUNT_ATTR_NOEXEC : 0);
+}
 
-  if (config.exec) {
-    if (config.args) {
-      for (auto it = config.args->rbegin(); it != config.args->rend(); ++it) {
-        args.push_front(*it);
-      }
-    }
-    args.push_front(*config.exec);
-  }
-  clearenv();
-  setenv("PATH", "/sbin:/bin:/usr/sbin:/usr/bin:/usr/local/sbin:/usr/local/bin", 1);
-  setenv("debian_chroot", state->build_root_orig.c_str(), 1);
-  for (auto &p : config.env) {
-    auto key = p.first;
-    auto val = p.second;
-    if (key.front() == '+') {
-      key = key.substr(1);
-      const auto cur_char = getenv(key.c_str());
-      string cur = cur_char ?: "";
-      if (!cur.empty()) val += ":";
-      val += cur;
-    } else if (key.back() == '+') {
-      key.pop_back();
-      const auto cur_char = getenv(key.c_str());
-      string cur = cur_char ?: "";
-      if (!cur.empty()) cur += ":";
-      val = cur + val;
-    }
-    setenv(key.c_str(), val.c_str(), 1);
+bool unshareNamespaces() {
+  if (unshare(
+    CLONE_FS |
+    CLONE_NEWCGROUP |
+    CLONE_NEWIPC |
+    CLONE_NEWNET |
+    CLONE_NEWNS |
+    CLONE_NEWPID |
+    // CLONE_NEWUSER |
+    CLONE_NEWUTS |
+    CLONE_SYSVSEM
+  )) {
+    cerr << "Failed to unshare namespaces " << errno << endl;
+    return false;
   }
+  return true;
+}
 
-  if (args.empty()) {
-    bool set_shell = false;
-    for (auto &shell : config.shell) {
-      if (fs::exists(state->build_root / shell.substr(1))) {
-        args.push_back(shell);
-        set_shell = true;
-        break;
-      }
+optional<Stage> mountInPlace(const Config &config, shared_ptr<State> state, const MountTable &mounts, const DetachedTree::TParams &overlay) {
+  TraceSpan stage("setup", "ROOT");
+  // Layers passed one at a time need the fsconfig() API
+  if (supportsLowerdirAppend()) {
+    DetachedTree root;
+    if (!root.create("overlay", state->build_root_orig, overlay, state->build_root) || !root.attach()) {
+      cerr << "Error mounting " << state->build_root << endl;
+      return Stage::MKTEMP;
     }
-    if (!set_shell) args.push_back(config.shell.size() ? config.shell[0] : "/bin/sh");
-  }
-
-  transform(args.begin(), args.end(), args.begin(), [&](string arg) {
-    size_t pos = 0;
-    while((pos = arg.find("$$build_root$$", pos)) != string::npos) {
-      arg.replace(pos, strlen("$$build_root$$"), state->build_root);
+  } else {
+    string options;
+    for (auto &p : overlay) {
+      if (!options.empty()) options += ",";
+      options += p.second.empty() ? p.first : p.first + "=" + p.second;
     }
-    return arg;
-  });
-
-  auto mounts = ProcMount::read();
-  if (ProcMount::any_of(mounts, [&](auto mnt) { return mnt.mnt_dir == state->build_root; })) {
-    cerr << state->build_root << " already mounted" << endl;
-    return Stage::MKTEMP;
-  }
 
-  string options = "lowerdir=" + config.optionsLower();
-
-  if (! config.noupper) {
-    auto base = config.base;
-    auto upperdir = state->build_root_orig;
-    upperdir += ".upper";
-    if (base) upperdir += "." + *base;
-    if (! fs::is_directory(upperdir)) fs::create_directory(upperdir);
-    auto workdir = state->build_root_orig;
-    workdir += ".work";
-    if (base) workdir += "." + *base;
-    if (! fs::is_directory(workdir)) fs::create_directory(workdir);
-    string upper_opts = ",upperdir=" + upperdir.string() + ",workdir=" + workdir.string();
-    if (ProcMount::any_of(mounts, [&](auto mnt) { return mnt.mnt_opts.find(upper_opts) != string::npos; })) {
-      cerr << "upperdir and workdir are alreadym mounted" << endl;
+    if (mount(state->build_root_orig, state->build_root, "overlay", 0, options)) {
+      cerr << "Error mounting " << state->build_root << " " << strerror(errno) << endl;
       return Stage::MKTEMP;
     }
-    options += upper_opts;
-  }
-
-  if (config.indexoff) {
-    options += ",index=off";
-  }
-
-  if (mount(state->build_root_orig, state->build_root, "overlay", 0, options)) {
-    cerr << "Error mounting " << state->build_root << " " << strerror(errno) << endl;
-    return Stage::MKTEMP;
   }
 
-  if (config.newnamespace) {
-    if (unshare(
-      CLONE_FS |
-      CLONE_NEWCGROUP |
-      CLONE_NEWIPC |
-      CLONE_NEWNET |
-      CLONE_NEWNS |
-      CLONE_NEWPID |
-      // CLONE_NEWUSER |
-      CLONE_NEWUTS |
-      CLONE_SYSVSEM
-    )) {
-      cerr << "Failed to unshare namespaces " << errno << endl;
-      return Stage::SYSTEM_FS;
-    }
+  stage.next("SYSTEM_FS");
+  if (config.newnamespace && !unshareNamespaces()) {
+    return Stage::SYSTEM_FS;
   }
 
   if (!config.newnamespace && !config.nosystem) {
-    auto mounts = ProcMount::by(ProcMount::read(), [](auto mnt) { return mnt.mnt_dir; });
     for (auto &fs : SYSTEM_FS) {
-      if (! mounts.count(fs)) {
+      if (config.recursivesystem && clonedWithParent(fs)) continue;
+      auto index = mounts.findMountPoint(fs);
+      if (index == MountTable::npos) {
         cerr << "System does not have " << fs << " mounted" << endl;
         return Stage::SYSTEM_FS;
       }
-      auto mount_fs = mounts[fs];
+      auto &mount_fs = mounts[index];
       auto dst = state->build_root / fs.substr(1);
-      if (mount(mount_fs.mnt_fsname, dst, mount_fs.mnt_type, 0, "")) {
+      if (config.recursivesystem) {
+        if (!bindTree(fs, dst, true, 0)) {
+          cerr << "Failed to clone " << fs << endl;
+          return Stage::SYSTEM_FS;
+        }
+      } else if (mount(string(mount_fs.source), dst, string(mount_fs.filesystem), 0, "")) {
         cerr << "Failed to mount " << fs << " " << strerror(errno) << endl;
         return Stage::SYSTEM_FS;
       }
-      state->mounted_system_fs.push_front(dst);
     }
   }
 
+  stage.next("BINDS");
   for (auto &bind : config.binds) {
     auto dst = state->build_root / bind.first.substr(1);
     if (! fs::exists(dst)) {
@@ -280,203 +234,585 @@ optional<Stage> start(deque<string> args, const Config &config, shared_ptr<State
       cerr << "bind mount destination " << bind.first << " is not a directory" << endl;
       return Stage::BINDS;
     }
-    if (mount(bind.second, dst, "bind", MS_BIND, "")) {
+    if (bind.second.hasOptions()) {
+      if (!bindTree(bind.second.src, dst, bind.second.recursive, bindAttr(bind.second))) {
+        cerr << "Failed to bind mount " << dst << endl;
+        return Stage::BINDS;
+      }
+    } else if (mount(bind.second.src, dst, "bind", MS_BIND, "")) {
       cerr << "Failed to bind mount " << dst << " " << strerror(errno) << endl;
       return Stage::BINDS;
     }
-    state->mounted_binds.push_back(dst);
   }
 
+  stage.next("TMPFS");
   for (auto &tmpfs : config.tmpfs) {
     auto dst = state->build_root / tmpfs.substr(1);
     if (mount("tmpfs", dst, "tmpfs", 0, "")) {
       cerr << "Failed to tmpfs mount " << dst << " " << strerror(errno) << endl;
       return Stage::TMPFS;
     }
-    state->mounted_tmpfs.push_back(dst);
   }
 
-  if (args.empty()) {
-    cerr << "Nothing to exec" << endl;
-    return Stage::PROCESSES;
+  return nullopt;
+}
+
+// Builds the whole chroot detached and attaches it in one go, see DetachedTree
+optional<Stage> mountDetached(const Config &config, shared_ptr<State> state, const MountTable &mounts, const DetachedTree::TParams &overlay) {
+  TraceSpan stage("setup", "ROOT");
+  // Nothing is attached yet, so the new namespace gets the finished tree
+  if (config.newnamespace && !unshareNamespaces()) {
+    return Stage::MKTEMP;
   }
 
-  {
-    const lock_guard<FileLock>lock(*state->mtabLock);
-    ofstream mtab("mtab", ios::app);
-    mtab << state->build_root_orig << " " << state->build_root << endl;
+  DetachedTree tree;
+  if (!tree.create("overlay", state->build_root_orig, overlay, state->build_root)) {
+    return Stage::MKTEMP;
   }
 
-  {
-    pid = fork();
-    if (pid == 0) {
-      fs::current_path(state->build_root);
-      if (! config.nochroot) {
-        if (chroot(".")) {
-          cerr << "Failed to chroot " << strerror(errno) << endl;
-          exit(-1);
+  // If the tree never got attached, dropping its fds released it and there is
+  // nothing left to unmount
+  auto failed = [&](Stage stage) -> optional<Stage> {
+    return tree.attached() ? stage : Stage::MKTEMP;
+  };
+
+  stage.next("SYSTEM_FS");
+  if (!config.newnamespace && !config.nosystem) {
+    for (auto &fs : SYSTEM_FS) {
+      if (config.recursivesystem && clonedWithParent(fs)) continue;
+      auto index = mounts.findMountPoint(fs);
+      if (index == MountTable::npos) {
+        cerr << "System does not have " << fs << " mounted" << endl;
+        return failed(Stage::SYSTEM_FS);
+      }
+      auto &mount_fs = mounts[index];
+      if (config.recursivesystem) {
+        if (!tree.bind(fs, fs, true)) {
+          cerr << "Failed to clone " << fs << endl;
+          return failed(Stage::SYSTEM_FS);
         }
-        fs::current_path(config.cwd);
+      } else if (!tree.mountFs(string(mount_fs.filesystem), string(mount_fs.source), {}, fs)) {
+        cerr << "Failed to mount " << fs << endl;
+        return failed(Stage::SYSTEM_FS);
       }
-      const char *argv[args.size() + 1];
-      for (size_t i = 0; i < args.size(); i++) {
-        argv[i] = args[i].c_str();
+    }
+  }
+
+  stage.next("BINDS");
+  for (auto &bind : config.binds) {
+    if (!tree.isDirectory(bind.first)) {
+      if (!tree.createDirectory(bind.first)) {
+        cerr << "Error creating missing bind destination for " << bind.first << endl;
+        if (config.noupper) {
+          cerr << "Likely caused by this chroot config having noupper set" << endl;
+        }
+        return failed(Stage::BINDS);
       }
-      argv[args.size()] = nullptr;
+    }
+    if (!tree.bind(bind.second.src, bind.first, bind.second.recursive, bindAttr(bind.second))) {
+      cerr << "Failed to bind mount " << bind.first << endl;
+      return failed(Stage::BINDS);
+    }
+  }
 
-      if (seteuid(getuid())) {
-        cerr << "Failed to seteuid" << endl;
-        exit(-1);
+  stage.next("TMPFS");
+  for (auto &tmpfs : config.tmpfs) {
+    if (!tree.mountFs("tmpfs", "tmpfs", {}, tmpfs)) {
+      cerr << "Failed to tmpfs mount " << tmpfs << endl;
+      return failed(Stage::TMPFS);
+    }
+  }
+
+  stage.next("ATTACH");
+  if (!tree.attach()) {
+    return failed(Stage::TMPFS);
+  }
+  return nullopt;
+}
+
+// Takes a reference on a shared build root another invocation has mounted
+bool joinShared(shared_ptr<State> state, const MountTable &mounts) {
+  if (mounts.findMountPoint(state->build_root.native()) == MountTable::npos) return false;
+  auto record = state->entry->read();
+  if (!record || record->src != state->build_root_orig) return false;
+  ++record->refs;
+  return state->entry->write(*record);
+}
+
+// Holds the upper and work directories of a scratch upper. Its path only
+// depends on the build root, so whoever tears a shared one down finds it.
+fs::path scratchDir(const Config &config, const State &state) {
+  auto scratch = state.build_root_orig;
+  scratch += ".scratch";
+  if (config.mktemp) scratch += "." + state.build_root.filename().string();
+  return scratch;
+}
+
+// The upperdir of a persistent upper
+fs::path upperDir(const Config &config, const State &state) {
+  auto upperdir = state.build_root_orig;
+  upperdir += ".upper";
+  if (config.base) upperdir += "." + *config.base;
+  return upperdir;
+}
+
+// The workdir of a persistent upper
+fs::path workDir(const Config &config, const State &state) {
+  auto workdir = state.build_root_orig;
+  workdir += ".work";
+  if (config.base) workdir += "." + *config.base;
+  return workdir;
+}
+
+// Created by a volatile overlay in its workdir. Overlayfs refuses the workdir
+// while it exists, so only a clean teardown removes it.
+fs::path volatileMarker(const Config &config, const State &state) {
+  return workDir(config, state) / "work" / "incompat" / "volatile";
+}
+
+optional<Stage> mountBuildRoot(const Config &config, shared_ptr<State> state, const MountTable &mounts) {
+  if (mounts.findMountPoint(state->build_root.native()) != MountTable::npos) {
+    cerr << state->build_root << " already mounted" << endl;
+    return Stage::MKTEMP;
+  }
+
+  DetachedTree::TParams overlay;
+  if (supportsLowerdirAppend()) {
+    for (auto &layer : state->layers.layers) overlay.emplace_back("lowerdir+", layer);
+  } else {
+    overlay.emplace_back("lowerdir", state->layers.lowerdir());
+  }
+
+  TraceSpan upper("setup", "UPPER");
+  // Holds a tmpfs upper until the overlay has its own reference to it
+  Fd upper_fs;
+  fs::path upper_attached;
+  if (! config.noupper) switch (config.upper) {
+    case UpperMode::TMPFS: {
+      DetachedTree::TParams params = { { "mode", "0755" } };
+      if (config.uppersize) params.emplace_back("size", *config.uppersize);
+      upper_fs = newMount("tmpfs", "upper", params);
+      if (!upper_fs) return Stage::MKTEMP;
+      for (auto dir : { "upper", "work" }) {
+        if (mkdirat(upper_fs.get(), dir, 0755)) {
+          cerr << "Failed to create " << dir << " on tmpfs " << strerror(errno) << endl;
+          return Stage::MKTEMP;
+        }
+      }
+      // Never attached anywhere, overlayfs reaches it through the fd
+      auto root = fs::path("/proc/self/fd") / to_string(upper_fs.get());
+      if (!supportsDetachedUpper()) {
+        // Older kernels want it attached, at a private directory until the
+        // overlay holds its own reference
+        root = scratchDir(config, *state);
+        if (mkdir(root.c_str(), 0700) && errno != EEXIST) {
+          cerr << "Failed to create " << root << " " << strerror(errno) << endl;
+          return Stage::MKTEMP;
+        }
+        if (!attachMount(upper_fs, root)) {
+          rmdir(root.c_str());
+          return Stage::MKTEMP;
+        }
+        upper_attached = root;
+      }
+      overlay.emplace_back("upperdir", root / "upper");
+      overlay.emplace_back("workdir", root / "work");
+      break;
+    }
+    case UpperMode::SCRATCH: {
+      auto scratch = scratchDir(config, *state);
+      // Left behind by an invocation that did not get to tear down
+      if (fs::exists(scratch)) discard(scratch);
+      if (mkdir(scratch.c_str(), 0700) || mkdir((scratch / "upper").c_str(), 0755) || mkdir((scratch / "work").c_str(), 0755)) {
+        cerr << "Failed to create " << scratch << " " << strerror(errno) << endl;
+        return Stage::MKTEMP;
+      }
+      overlay.emplace_back("upperdir", scratch / "upper");
+      overlay.emplace_back("workdir", scratch / "work");
+      break;
+    }
+    case UpperMode::PERSISTENT: {
+      auto upperdir = upperDir(config, *state);
+      if (! fs::is_directory(upperdir)) fs::create_directory(upperdir);
+      auto workdir = workDir(config, *state);
+      if (! fs::is_directory(workdir)) fs::create_directory(workdir);
+      if (
+        mounts.findOverlayDir(upperdir.native()) != MountTable::npos ||
+        mounts.findOverlayDir(workdir.native()) != MountTable::npos
+      ) {
+        cerr << "upperdir and workdir are alreadym mounted" << endl;
+        return Stage::MKTEMP;
       }
+      if (fs::exists(volatileMarker(config, *state))) {
+        cerr << upperdir << " was left by a volatile mount that was not torn down, remove it and " << workdir << endl;
+        return Stage::MKTEMP;
+      }
+      overlay.emplace_back("upperdir", upperdir);
+      overlay.emplace_back("workdir", workdir);
+      break;
+    }
+  }
+
+  for (auto &option : config.overlayOptions()) overlay.push_back(option);
+  upper.end();
+
+  auto failed = config.atomicmount
+    ? mountDetached(config, state, mounts, overlay)
+    : mountInPlace(config, state, mounts, overlay);
+  if (!upper_attached.empty() && (umountRecursive(upper_attached) || rmdir(upper_attached.c_str()))) {
+    cerr << "Failed to remove the tmpfs upper from " << upper_attached << " " << strerror(errno) << endl;
+  }
+  return failed;
+}
+
+// Mounts the build root, or joins a shared one, and registers it
+optional<Stage> setup(const Config &config, shared_ptr<State> state) {
+  if (config.shared && (config.mktemp || config.newnamespace)) {
+    cerr << "shared cannot be combined with mktemp or newnamespace" << endl;
+    return Stage::NONE;
+  }
+
+  TraceSpan stage("setup", "MKTEMP");
+  if (config.mktemp) {
+    string tmp = "/tmp/chroot-XXXXXX";
+    if (! mkdtemp(tmp.data())) {
+      cerr << "Failed to create temp dir" << endl;
+      return Stage::NONE;
+    }
+    state->build_root = tmp;
+  }
+
+  stage.next("MTAB");
+  state->entry = StateEntry::open("mtab.d", state->build_root);
+  if (!state->entry) return Stage::MKTEMP;
+
+  // Held from checking for a shared build root until it is registered
+  unique_lock<StateEntry> lock(*state->entry, defer_lock);
+  if (config.shared) lock.lock();
+  TraceSpan read("proc", "mountinfo");
+  auto mounts = MountTable::read();
+  read.end();
+  bool joined = config.shared && joinShared(state, mounts);
+
+  if (!joined) {
+    stage.end();
+    auto mounted = mountBuildRoot(config, state, mounts);
+    if (mounted) return mounted;
+
+    stage.next("MTAB");
+    if (!lock.owns_lock()) lock.lock();
+    if (!state->entry->write({ state->build_root_orig, state->build_root, 1 })) return Stage::MTAB;
+  }
+  lock.unlock();
+
+  stage.next("PROCESSES");
+  if (config.cgroup) {
+    auto name = state->build_root.filename().string() + "." + state->instance;
+    if (!state->cgroup.create(*config.cgroup, name)) return Stage::MTAB;
+  }
+  return nullopt;
+}
 
-      cerr << "execve: " << argv[0];
-      for (auto &arg : args) {
-        cerr << " "  << arg;
+// The command line to run, falling back to the configured exec or shell
+deque<string> commandArgs(deque<string> args, const Config &config, const State &state) {
+  if (config.exec) {
+    if (config.args) {
+      for (auto it = config.args->rbegin(); it != config.args->rend(); ++it) {
+        args.push_front(*it);
       }
-      cerr << endl;
+    }
+    args.push_front(*config.exec);
+  }
 
-      int fdlimit = ::sysconf(_SC_OPEN_MAX);
-      for (int i = 3; i < fdlimit; ++i) {
-        if (state->keepfd.contains(i)) {
-          cerr << "Keeping " << i << endl;
-          continue;
-        }
-        close(i);
+  if (args.empty()) {
+    bool set_shell = false;
+    for (auto &shell : config.shell) {
+      if (fs::exists(state.build_root / shell.substr(1))) {
+        args.push_back(shell);
+        set_shell = true;
+        break;
       }
+    }
+    if (!set_shell) args.push_back(config.shell.size() ? config.shell[0] : "/bin/sh");
+  }
 
-      if (execve(argv[0], (char *const *)&argv, environ)) {
-        cerr << "Failed to exec " << argv[0] << " " << strerror(errno) << endl;
+  transform(args.begin(), args.end(), args.begin(), [&](string arg) {
+    size_t pos = 0;
+    while((pos = arg.find("$$build_root$$", pos)) != string::npos) {
+      arg.replace(pos, strlen("$$build_root$$"), state.build_root);
+    }
+    return arg;
+  });
+  return args;
+}
+
+// Sets env, where a key of +NAME prepends to and NAME+ appends to the
+// current value
+void applyEnv(const map<string, string> &env) {
+  for (auto &p : env) {
+    auto key = p.first;
+    auto val = p.second;
+    if (key.front() == '+') {
+      key = key.substr(1);
+      const auto cur_char = getenv(key.c_str());
+      string cur = cur_char ?: "";
+      if (!cur.empty()) val += ":";
+      val += cur;
+    } else if (key.back() == '+') {
+      key.pop_back();
+      const auto cur_char = getenv(key.c_str());
+      string cur = cur_char ?: "";
+      if (!cur.empty()) cur += ":";
+      val = cur + val;
+    }
+    setenv(key.c_str(), val.c_str(), 1);
+  }
+}
+
+// Forks a child that enters the build root and execs args, with env set
+// on top of the configured environment, or serves the listener as zygote
+pid_t spawn(const deque<string> &args, const Config &config, shared_ptr<State> state, const map<string, string> &env, Fd listener) {
+  auto pid = fork();
+  if (pid < 0) {
+    cerr << "Failed to fork " << strerror(errno) << endl;
+  } else if (pid == 0) {
+    supervisor.restoreMask();
+    if (state->cgroup && !state->cgroup.enter()) {
+      cerr << "Failed to enter cgroup " << state->cgroup.path() << " " << strerror(errno) << endl;
+      exit(-1);
+    }
+    clearenv();
+    setenv("PATH", "/sbin:/bin:/usr/sbin:/usr/bin:/usr/local/sbin:/usr/local/bin", 1);
+    setenv("debian_chroot", state->build_root_orig.c_str(), 1);
+    applyEnv(config.env);
+    applyEnv(env);
+
+    // Looked up while the build root is still reachable by its host path
+    auto shell = listener ? commandArgs({}, config, *state) : deque<string>();
+
+    fs::current_path(state->build_root);
+    if (! config.nochroot) {
+      if (chroot(".")) {
+        cerr << "Failed to chroot " << strerror(errno) << endl;
+        exit(-1);
+      }
+      fs::current_path(config.cwd);
+    }
+    const char *argv[args.size() + 1];
+    for (size_t i = 0; i < args.size(); i++) {
+      argv[i] = args[i].c_str();
+    }
+    argv[args.size()] = nullptr;
+
+    if (seteuid(getuid())) {
+      cerr << "Failed to seteuid" << endl;
+      exit(-1);
+    }
+
+    if (listener) {
+      // It never execs, which is what drops the saved uid of a command
+      if (setresgid(getgid(), getgid(), getgid()) || setresuid(getuid(), getuid(), getuid())) {
+        cerr << "Failed to drop privileges " << strerror(errno) << endl;
         exit(-1);
       }
-    } else if (pid > 0) {
-      int wstatus;
-      waitpid(pid, &wstatus, 0);
-      state->exitstatus = WEXITSTATUS(wstatus);
-    } else {
-      cerr << "Failed to fork " << strerror(errno) << endl;
-      return Stage::MTAB;
+      cerr << "zygote: serving " << socketPath(*state) << endl;
+      auto command = [&](vector<string> args) {
+        auto full = args.empty() ? shell : commandArgs({ args.begin(), args.end() }, config, *state);
+        return vector<string>(full.begin(), full.end());
+      };
+      exit(runZygote(move(listener), killTimeout(config), command));
     }
+
+    cerr << "execve: " << argv[0];
+    for (auto &arg : args) {
+      cerr << " "  << arg;
+    }
+    cerr << endl;
+
+    for (auto &[dst, src] : state->keepfd) {
+      if (dst == src) cerr << "Keeping " << dst << endl;
+      else cerr << "Moving " << src << " to " << dst << endl;
+    }
+    if (!inheritFds(state->keepfd)) exit(-1);
+
+    if (execve(argv[0], (char *const *)&argv, environ)) {
+      cerr << "Failed to exec " << argv[0] << " " << strerror(errno) << endl;
+      exit(-1);
+    }
+  }
+  return pid;
+}
+
+optional<Stage> start(deque<string> args, const Config &config, shared_ptr<State> state) {
+  auto failed = setup(config, state);
+  if (failed) return failed;
+
+  args = commandArgs(move(args), config, *state);
+  if (args.empty()) {
+    cerr << "Nothing to exec" << endl;
+    return Stage::MTAB;
+  }
+
+  Fd listener;
+  if (state->daemon) {
+    listener = listenZygote(socketPath(*state));
+    if (!listener) return Stage::MTAB;
+  }
+
+  TraceSpan child("child", state->daemon ? "zygote" : "command");
+  auto pid = spawn(args, config, state, {}, move(listener));
+  if (pid < 0) return Stage::MTAB;
+  child.arg("pid", to_string(pid));
+  auto reason = supervisor.wait(pid, killTimeout(config));
+  if (reason) child.arg("status", to_string(reason->exitCode()));
+  child.end();
+  if (state->daemon) fs::remove(socketPath(*state));
+  if (!reason) return Stage::MTAB;
+  if (reason->signaled || reason->status) {
+    cerr << (state->daemon ? "zygote" : args[0]) << " " << *reason << endl;
   }
+  state->exitstatus = reason->exitCode();
   return nullopt;
 }
 
+bool teardown(optional<Stage> ret, const Config &config, shared_ptr<State> state);
+
+// Waits out the linger of a shared build root in a detached process, which
+// then tears it down unless it has been joined since, so the caller exits
+// at once
+void lingerInBackground(const Config &config, shared_ptr<State> state) {
+  auto pid = fork();
+  if (pid == 0) {
+    if (fork() == 0) {
+      setsid();
+      sigset_t none;
+      sigemptyset(&none);
+      sigprocmask(SIG_SETMASK, &none, nullptr);
+      // Holding on to the caller's output would keep whoever reads it
+      // waiting out the linger too
+      int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+      if (null < 0 || !inheritFds({ { 0, null }, { 1, null }, { 2, null } })) _exit(1);
+      // Their fds are gone, dropped before anything reuses the numbers.
+      // The caller has taken care of its own processes.
+      state->cgroup = Cgroup();
+      state->entry.reset();
+      state->entry = StateEntry::open("mtab.d", state->build_root);
+      if (!state->entry) _exit(1);
+      this_thread::sleep_for(chrono::duration<double>(config.linger));
+      _exit(teardown(nullopt, config, state));
+    }
+    _exit(0);
+  }
+  if (pid > 0) waitpid(pid, nullptr, 0);
+}
+
 optional<Stage> stop(optional<Stage> stage, const Config &config, shared_ptr<State> state) {
   auto cleanup = stage ? *stage : Stage::MTAB;
+  unique_lock<StateEntry> lock;
+  if (state->entry) lock = unique_lock<StateEntry>(*state->entry, defer_lock);
   switch(cleanup) {
     case Stage::MTAB: {
-      const lock_guard<FileLock>lock(*state->mtabLock);
-      vector<pair<fs::path, fs::path>> mtabContent;
-      {
-        ifstream mtab;
-        mtab.open("mtab");
-        mtab.exceptions(ifstream::failbit | ifstream::eofbit);
-        while(!mtab.eof()) {
-          try {
-            fs::path src;
-            fs::path dst;
-            mtab >> src;
-            mtab >> dst;
-            if (src == state->build_root_orig && dst == state->build_root) continue;
-            mtabContent.emplace_back(src, dst);
-          } catch (exception &e){
-            break;
-          }
+      TraceSpan span("teardown", "MTAB");
+      lock.lock();
+      auto record = state->entry->read();
+      bool linger = false;
+      if (config.shared && record) {
+        if (state->lingers) {
+          // Joined meanwhile, or left lingering again by a later invocation
+          state->keep_mounts = record->refs || record->lingers != state->lingers;
+        } else if (record->refs > 1) {
+          --record->refs;
+          state->keep_mounts = true;
+        } else if (config.linger > 0) {
+          // Stay mounted for a while, for the next invocation to join
+          record->refs = 0;
+          state->lingers = ++record->lingers;
+          state->keep_mounts = linger = true;
         }
       }
-      {
-        ofstream mtab("mtab", ios::trunc);
-        for (auto &e : mtabContent) {
-          try {
-            mtab << e.first << " " << e.second << endl;
-          } catch (exception &e) {
-            cerr << "Error writing mtab " << e.what() << endl;
-          }
-        }
+      if (state->keep_mounts) {
+        if (!state->entry->write(*record)) return Stage::MTAB;
+        lock.unlock();
+        if (linger) lingerInBackground(config, state);
+      } else {
+        if (!state->entry->remove(config.mktemp)) return Stage::MTAB;
+        // Keep joiners out until the shared mounts are gone
+        if (!config.shared) lock.unlock();
       }
     }
     // FALLTHROUGH
     case Stage::PROCESSES: {
-      bool killed = false;
-      for (auto &p : fs::directory_iterator("/proc")) {
-        auto root = p.path() / "root";
-        try {
-          if (fs::is_symlink(root)) {
-            auto fn = p.path().filename().string();
-            if (fn == "self" || fn == "thread-self") continue;
-            auto pid = stoll(fn);
-            if (fs::read_symlink(root) == state->build_root) {
-              cerr << "Killing lingering process " << pid << endl;
-              killed = true;
-              if (kill(pid, SIGTERM)) {
-                cerr << "Error killing process " << pid << endl;
-                return Stage::PROCESSES;
+      TraceSpan span("teardown", "PROCESSES");
+      if (state->cgroup) {
+        if (!state->cgroup.kill(killTimeout(config).count()) || !state->cgroup.remove()) return Stage::PROCESSES;
+      } else if (!state->keep_mounts) {
+        // Processes are only told apart by their root, so this would also
+        // hit other users of a shared build root
+        vector<pid_t> lingering;
+        TraceSpan scan("proc", "roots");
+        for (auto &p : fs::directory_iterator("/proc")) {
+          auto root = p.path() / "root";
+          try {
+            if (fs::is_symlink(root)) {
+              auto fn = p.path().filename().string();
+              if (fn == "self" || fn == "thread-self") continue;
+              auto pid = stoll(fn);
+              if (fs::read_symlink(root) == state->build_root) {
+                cerr << "Killing lingering process " << pid << endl;
+                lingering.push_back(pid);
               }
             }
-          }
-        } catch (fs::filesystem_error &e) {}
-      }
-      if (killed) sleep(1);
-    }
-    // FALLTHROUGH
-    case Stage::TMPFS: {
-      for (auto it = state->mounted_tmpfs.cbegin(); it != state->mounted_tmpfs.cend(); it ) {
-        auto dst = *it;
-        if (umount(dst)) {
-          cerr << "Failed to umount tmpfs " << dst << " " << strerror(errno) << endl;
-          return Stage::TMPFS;
-        }
-        it = state->mounted_tmpfs.erase(it);
-      }
-    }
-    // FALLTHROUGH
-    case Stage::BINDS: {
-      for (auto it = state->mounted_binds.cbegin(); it != state->mounted_binds.cend(); it ) {
-        auto dst = *it;
-        if (umount(dst)) {
-          cerr << "Failed to umount bind " << dst << " " << strerror(errno) << endl;
-          return Stage::BINDS;
-        }
-        it = state->mounted_binds.erase(it);
-      }
-    }
-    // FALLTHROUGH
-    case Stage::SYSTEM_FS: {
-      if (! config.nosystem) {
-        for (auto it = state->mounted_system_fs.cbegin(); it != state->mounted_system_fs.cend(); it) {
-          auto dst = *it;
-          if (umount(dst)) {
-            cerr << "Failed to umount " << dst << " " << strerror(errno) << endl;
-            return Stage::SYSTEM_FS;
-          }
-          it = state->mounted_system_fs.erase(it);
+          } catch (fs::filesystem_error &e) {}
         }
+        scan.end();
+        if (!terminate(lingering, killTimeout(config))) return Stage::PROCESSES;
       }
+      if (state->keep_mounts) break;
     }
     // FALLTHROUGH
+    case Stage::TMPFS:
+    case Stage::BINDS:
+    case Stage::SYSTEM_FS:
     case Stage::ROOT: {
-
-      auto root = ProcMountInfo::read()->findMountPoint(state->build_root);
-      if (root && !root->children.empty()) {
-        cerr << "Found dangling mounts inside chroot:" << endl << root << endl;
-        auto children = root->recursiveChildren();
-        for (auto it = children.crbegin(); it != children.crend(); ++it) {
-          auto mnt = *it;
-          if (umount(mnt->mount_point)) {
-            cerr << "Failed to umount dangling child mount " << mnt->mount_point << endl;
-            return Stage::ROOT;
-          }
-        }
+      TraceSpan span("teardown", "ROOT");
+      vector<string> busy;
+      bool released = umountTree(state->build_root, config.lazyumount, busy);
+      if (!busy.empty()) {
+        cerr << (released ? "Lazily detached busy mounts:" : "Busy mounts:") << endl;
+        for (auto &mnt : busy) cerr << "  " << mnt << endl;
       }
-
-      if (umount(state->build_root)) {
-        cerr << "Failed to umount" << state->build_root << " " << strerror(errno) << endl;
+      if (!released) {
+        cerr << "Failed to umount " << state->build_root << endl;
         return Stage::ROOT;
       }
+      if (!config.noupper && config.upper == UpperMode::SCRATCH && fs::exists(scratchDir(config, *state))) {
+        discard(scratchDir(config, *state));
+      }
+      // Overlayfs leaves copy up and whiteout leftovers, and the volatile
+      // marker, in work/ and creates it anew on mount. It may still be in use
+      // by a lazily detached overlay.
+      auto work = workDir(config, *state) / "work";
+      if (!config.noupper && config.upper == UpperMode::PERSISTENT && busy.empty() && fs::exists(work)) {
+        // A volatile overlay skipped every sync, and its marker in work/ is
+        // all that says the upper may be incomplete after a crash, so it
+        // only goes once the upper is on disk
+        bool synced = true;
+        if (config.overlay.nosync) {
+          Fd upper(open(upperDir(config, *state).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+          synced = upper && !syncfs(upper.get());
+          if (!synced) cerr << "Failed to sync " << upperDir(config, *state) << " " << strerror(errno) << endl;
+        }
+        if (synced) discard(work, Trash(state->build_root_orig.parent_path()));
+      }
     }
     // FALLTHROUGH
     case Stage::MKTEMP: {
+      TraceSpan span("teardown", "MKTEMP");
       if (config.mktemp) {
-        fs::remove(state->build_root);
+        // Only a mount point, and empty unless a mount failed to go
+        error_code ec;
+        fs::remove(state->build_root, ec);
+        if (ec == errc::directory_not_empty) discard(state->build_root);
       }
     }
     // FALLTHROUGH
@@ -513,96 +849,402 @@ bool check_permissions(const fs::path &config_file) {
   return true;
 }
 
+// Resolves a build root named on the command line or in a manifest, which
+// must be a relative subdirectory of the binary's directory
+optional<fs::path> buildRootPath(const fs::path &build_root) {
+  if (build_root.has_root_path()) {
+    cerr
+      << "Only relative subdirectories of "
+      << fs::current_path()
+      << " are allowed."
+      << endl;
+    return nullopt;
+  }
+
+  if (any_of(build_root.begin(), build_root.end(), [](auto p) { return p == ".."; })) {
+    cerr
+      << "No .. relative operators are allowed." << endl;
+    return nullopt;
+  }
+  return fs::absolute(build_root);
+}
+
+optional<Config> loadConfig(const State &state, const optional<string> &base, ConfigCache &cache) {
+  if (! fs::is_directory(state.build_root)) {
+    cerr << state.build_root << " is not a directory" << endl;
+    return nullopt;
+  }
+
+  auto build_file = state.build_root / ".buildroot.yaml";
+
+  // A shared build root may already be mounted over its config
+  Fd underlying;
+  if (isMountPoint(state.build_root)) {
+    underlying = openUnderlying(state.build_root);
+    if (!underlying) return nullopt;
+    build_file = fs::path("/proc/self/fd") / to_string(underlying.get()) / state.build_root.filename() / ".buildroot.yaml";
+  }
+
+  if (!check_permissions(build_file)) return nullopt;
+
+  TraceSpan span("config", "load");
+  span.arg("build_root", state.build_root);
+  Config config;
+  try {
+    config = cache.load(state.build_root / ".buildroot.yaml", build_file);
+  } catch (exception &e) {
+    cerr << "Failed to load " << state.build_root / ".buildroot.yaml" << " " << e.what() << endl;
+    return nullopt;
+  }
+
+  if (base) config.base = *base;
+  if (!config.validate()) return nullopt;
+  return config;
+}
+
+// Runs stop() until it succeeds, retrying a few times. Returns whether
+// anything went wrong on the way.
+bool teardown(optional<Stage> ret, const Config &config, shared_ptr<State> state) {
+  int retries = 3;
+  const bool was_error = !!ret;
+  do {
+    ret = stop(ret, config, state);
+    if (ret) {
+      cerr <<  "Error occurred whilst stopping";
+      if (retries) {
+        cerr << " retrying";
+        sleep(1);
+      }
+      cerr << endl;
+    }
+  } while (ret && retries--);
+  return was_error || ret;
+}
+
+// Runs the jobs of a manifest, at most limit at a time. Each build root is
+// set up once, before its first job, and torn down after its last. Jobs of
+// build roots that are already mounted go first, so the next build root is
+// only mounted once those run out. Results go to stdout as jobs finish, and
+// the jobs' own output to stderr.
+int runBatch(const string &manifest, size_t limit, const optional<string> &base) {
+  // Read with the permissions of the caller rather than root's
+  if (seteuid(getuid())) {
+    cerr << "Failed to seteuid" << endl;
+    return 1;
+  }
+  auto jobs = loadManifest(manifest);
+  if (seteuid(0)) {
+    cerr << "Failed to restore euid" << endl;
+    return 1;
+  }
+  if (!jobs) return 1;
+
+  Fd null(open("/dev/null", O_RDONLY | O_CLOEXEC));
+  if (!null) {
+    cerr << "Failed to open /dev/null " << strerror(errno) << endl;
+    return 1;
+  }
+
+  struct Group {
+    shared_ptr<State> state;
+    optional<Config> config;
+    deque<size_t> pending;
+    size_t running = 0;
+    bool mounted = false;
+  };
+  struct Running {
+    size_t job;
+    size_t group;
+    chrono::steady_clock::time_point started;
+  };
+
+  bool failed = false;
+  auto report = [&](const BatchResult &result) {
+    failed |= result.error || result.status;
+    cout << result << endl;
+  };
+  auto fail = [&](size_t job, const string &error) {
+    BatchResult result;
+    result.job = job;
+    result.build_root = (*jobs)[job].build_root;
+    result.error = error;
+    report(result);
+  };
+
+  // Each build root's config is loaded once, for all of its jobs
+  TraceSpan read("config", "cache");
+  ConfigCache cache("config.cache");
+  read.end();
+  vector<Group> groups;
+  map<fs::path, size_t> group_of;
+  for (size_t job = 0; job < jobs->size(); ++job) {
+    auto path = buildRootPath((*jobs)[job].build_root);
+    if (!path) {
+      fail(job, "invalid build root");
+      continue;
+    }
+    auto [it, added] = group_of.emplace(*path, groups.size());
+    if (added) {
+      Group group;
+      group.state = make_shared<State>(*path);
+      group.state->instance += "." + to_string(groups.size());
+      group.state->keepfd = { { 0, null.get() }, { 1, 2 }, { 2, 2 } };
+      group.config = loadConfig(*group.state, base, cache);
+      if (group.config) {
+        TraceSpan layers("config", "layers");
+        group.state->layers = cache.layers(*group.config);
+      }
+      groups.push_back(move(group));
+    }
+    auto &group = groups[it->second];
+    if (group.config) group.pending.push_back(job);
+    else fail(job, "failed to load config");
+  }
+  TraceSpan save("config", "save");
+  cache.save();
+  save.end();
+
+  auto finish = [&](Group &group) {
+    if (!group.mounted || group.running || !group.pending.empty()) return;
+    group.mounted = false;
+    failed |= teardown(nullopt, *group.config, group.state);
+  };
+
+  size_t next_group = 0;
+  auto pick = [&]() -> optional<size_t> {
+    for (size_t i = 0; i < groups.size(); ++i) {
+      if (groups[i].mounted && !groups[i].pending.empty()) return i;
+    }
+    for (; next_group < groups.size(); ++next_group) {
+      auto &group = groups[next_group];
+      if (group.pending.empty()) continue;
+      auto stage = setup(*group.config, group.state);
+      if (stage) {
+        teardown(stage, *group.config, group.state);
+        for (auto job : group.pending) fail(job, "failed to set up build root");
+        group.pending.clear();
+        continue;
+      }
+      group.mounted = true;
+      return next_group++;
+    }
+    return nullopt;
+  };
+
+  map<pid_t, Running> running;
+  while (true) {
+    while (!supervisor.interrupted() && supervisor.running() < limit) {
+      auto index = pick();
+      if (!index) break;
+      auto &group = groups[*index];
+      auto job = group.pending.front();
+      group.pending.pop_front();
+
+      auto &spec = (*jobs)[job];
+      auto args = commandArgs({ spec.command.begin(), spec.command.end() }, *group.config, *group.state);
+      auto timeout = chrono::duration_cast<chrono::milliseconds>(chrono::duration<double>(spec.timeout));
+      auto pid = spawn(args, *group.config, group.state, spec.env, Fd());
+      if (pid < 0) {
+        fail(job, "failed to start");
+      } else if (!supervisor.watch(pid, killTimeout(*group.config), timeout)) {
+        // Left to the teardown of its build root
+        fail(job, "failed to supervise");
+      } else {
+        ++group.running;
+        running[pid] = { job, *index, chrono::steady_clock::now() };
+      }
+      finish(group);
+    }
+
+    if (supervisor.interrupted()) {
+      for (auto &group : groups) {
+        for (auto job : group.pending) fail(job, "interrupted");
+        group.pending.clear();
+        finish(group);
+      }
+    }
+    if (!supervisor.running()) break;
+
+    auto exited = supervisor.next();
+    if (!exited) {
+      failed = true;
+      break;
+    }
+    auto [pid, reason] = *exited;
+    auto it = running.find(pid);
+    auto [job, index, started] = it->second;
+    running.erase(it);
+
+    BatchResult result;
+    result.job = job;
+    result.build_root = (*jobs)[job].build_root;
+    result.status = reason.exitCode();
+    if (reason.signaled) result.signal = reason.status;
+    result.core_dumped = reason.core_dumped;
+    result.timed_out = reason.timed_out;
+    auto ended = chrono::steady_clock::now();
+    result.seconds = chrono::duration<double>(ended - started).count();
+    report(result);
+    // On a track of its own, as jobs overlap
+    if (tracer.enabled()) {
+      tracer.record("child", "job", started, ended, {
+        { "job", to_string(job) },
+        { "build_root", result.build_root },
+        { "status", to_string(result.status) },
+      }, pid);
+    }
+
+    --groups[index].running;
+    finish(groups[index]);
+  }
+
+  // Only left mounted when supervising failed, stop() deals with the jobs
+  for (auto &group : groups) {
+    if (group.mounted) failed |= teardown(nullopt, *group.config, group.state);
+  }
+  return failed;
+}
+
 int main(int argc, const char *argv[]) {
   std::map<std::string, docopt::value> args
       = docopt::docopt(USAGE, { argv + 1, argv + argc }, true, "", true);
 
-  signal(SIGINT, signalHandler);
-  signal(SIGTERM, signalHandler);
-
+  // Where a --connect client runs its command
+  auto cwd = fs::current_path();
   fs::current_path(fs::absolute(argv[0]).parent_path());
 
-  shared_ptr<State> state;
-  {
-    fs::path build_root = args["<chroot-name>"].asString();
-
-    if (build_root.has_root_path()) {
-      cerr
-        << "Only relative subdirectories of "
-        << fs::current_path()
-        << " are allowed."
-        << endl;
+  verbose = !!args["--verbose"];
+
+  if (args["--trace"]) {
+    // Written with the permissions of the caller rather than root's
+    if (seteuid(getuid())) {
+      cerr << "Failed to seteuid" << endl;
       return 1;
     }
+    bool traced = tracer.open(cwd / args["--trace"].asString());
+    if (seteuid(0)) {
+      cerr << "Failed to restore euid" << endl;
+      return 1;
+    }
+    if (!traced) return 1;
+  }
+
+  optional<string> base;
+  if (args["--base"]) {
+    base = args["--base"].asString();
+  }
 
-    if (any_of(build_root.begin(), build_root.end(), [](auto p) { return p == ".."; })) {
-      cerr
-        << "No .. relative operators are allowed." << endl;
+  size_t jobs = max(thread::hardware_concurrency(), 1u);
+  if (args["--jobs"]) {
+    auto value = args["--jobs"].asString();
+    try {
+      jobs = stoul(value);
+    } catch (exception &e) {
+      jobs = 0;
+    }
+    if (!jobs) {
+      cerr << "Failed to convert '" << value << "' to a number of jobs" << endl;
       return 1;
     }
-    build_root = fs::absolute(build_root);
-    state = make_shared<State>(build_root);
   }
 
-  verbose = !!args["--verbose"];
+  if (args["--store"]) {
+    // Reads every file under the build root with root's permissions
+    if (getuid()) {
+      cerr << "--store is only available to root" << endl;
+      return 1;
+    }
+    auto dir = buildRootPath(args["--store"].asString());
+    if (!dir) return 1;
+    auto ref = LayerStore("layers.d").import(*dir, jobs);
+    if (!ref) return 1;
+    cout << *ref << endl;
+    return 0;
+  }
+
+  if (args["--batch"]) {
+    if (!supervisor.init()) return 1;
+    return runBatch(args["--batch"].asString(), jobs, base);
+  }
+
+  shared_ptr<State> state;
+  {
+    auto build_root = buildRootPath(args["<chroot-name>"].asString());
+    if (!build_root) return 1;
+    state = make_shared<State>(*build_root);
+  }
 
   if (args["--keepfd"]) {
     for (auto s : args["--keepfd"].asStringList()) {
-      try {
-        state->keepfd.insert(stoi(s));
-      } catch (exception &e) {
-        cerr << "Failed to convert '" << s << "' to an integer" << endl;
+      auto fd = parseKeepFd(s);
+      if (!fd) {
+        cerr << "Failed to convert '" << s << "' to an fd or src:dst pair" << endl;
+        return 1;
+      }
+      if (!state->keepfd.insert(*fd).second) {
+        cerr << "fd " << fd->first << " is kept more than once" << endl;
         return 1;
       }
     }
   }
 
-  if (! fs::is_directory(state->build_root)) {
-    cerr << state->build_root << " is not a directory" << endl;
-    return 1;
+  if (args["--connect"].asBool()) {
+    if (seteuid(getuid())) {
+      cerr << "Failed to seteuid" << endl;
+      return 1;
+    }
+    auto commandArgs = args["<command-or-args>"].asStringList();
+    return runClient(socketPath(*state), { commandArgs.begin(), commandArgs.end() }, cwd, state->keepfd);
   }
 
-  auto build_file = state->build_root / ".buildroot.yaml";
+  if (!supervisor.init()) return 1;
+  state->daemon = args["--daemon"].asBool();
 
   cout << state->build_root << endl;
 
-  if (!check_permissions(build_file)) return 1;
-
-  auto config = Config::loadFile(build_file);
-
-  if (args["--base"]) {
-    config.base = args["--base"].asString();
+  TraceSpan span("config", "cache");
+  ConfigCache cache("config.cache");
+  span.end();
+  auto config = loadConfig(*state, base, cache);
+  if (!config) return 1;
+  span.next("layers");
+  state->layers = cache.layers(*config);
+  span.next("save");
+  cache.save();
+  span.end();
+
+  if (args["--squash"]) {
+    // The tree keeps the owners and set-id bits of the layers
+    if (getuid()) {
+      cerr << "--squash is only available to root" << endl;
+      return 1;
+    }
+    fs::path layer = args["--squash"].asString();
+    if (!buildRootPath(layer)) return 1;
+    return !squashLayers(state->layers.layers, layer, jobs);
   }
 
   if (args["--print"].asBool()) {
-    YAML::Node cfg(config);
+    YAML::Node cfg(*config);
     cerr << cfg << endl;
     return 99;
   }
 
   auto commandArgs = args["<command-or-args>"].asStringList();
 
-  auto ret = start({commandArgs.begin(), commandArgs.end()}, config, state);
-
-  int retries = 3;
-  const bool was_error = !!ret;
-  do {
-    ret = stop(ret, config, state);
-    if (ret) {
-      cerr <<  "Error occurred whilst stopping";
-      if (retries) {
-        cerr << " retrying";
-        sleep(1);
-      }
-      cerr << endl;
-    }
-  } while (ret && retries--);
-
-  return state->exitstatus | (was_error || ret);
+  auto ret = start({commandArgs.begin(), commandArgs.end()}, *config, state);
+  return state->exitstatus | teardown(ret, *config, state);
 }
 
 } // namespace
 
 int main(int argc, const char *argv[]) {
-  return chroot_venv::main(argc, argv);
+  auto started = chroot_venv::Tracer::Clock::now();
+  auto ret = chroot_venv::main(argc, argv);
+  auto &tracer = chroot_venv::tracer;
+  if (tracer.enabled()) {
+    tracer.record("main", "run", started, chroot_venv::Tracer::Clock::now());
+    tracer.write();
+  }
+  return ret;
 }
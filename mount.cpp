@@ -0,0 +1,272 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "mount.hpp"
+#include "procmounts.hpp"
+#include "trace.hpp"
+
+using namespace std;
+namespace fs = filesystem;
+
+using namespace procmounts;
+
+namespace chroot_venv {
+
+int mount(string src, string dst, string fs, int flags, string opts) {
+  TraceSpan span("syscall", "mount");
+  span.arg("target", dst);
+  if (verbose)
+    cerr << "mount(" << src << ", " << dst << ", " << fs << ", " << flags << ", " << opts << ")" << endl;
+  return ::mount(src.c_str(), dst.c_str(), fs.c_str(), flags, opts.c_str());
+}
+
+int umount(string dst) {
+  TraceSpan span("syscall", "umount");
+  span.arg("target", dst);
+  if (verbose)
+    cerr << "umount(" << dst << ")" << endl;
+  return ::umount(dst.c_str());
+}
+
+int umountRecursive(string dst) {
+  TraceSpan span("syscall", "umount2");
+  span.arg("target", dst);
+  if (verbose)
+    cerr << "umount2(" << dst << ", MNT_DETACH)" << endl;
+  return ::umount2(dst.c_str(), MNT_DETACH);
+}
+
+bool umountTree(const string &root, bool lazy, vector<string> &busy) {
+  TraceSpan read("proc", "mountinfo");
+  auto table = MountTable::listSubtree(root);
+  read.end();
+  auto top = table.root();
+  if (top == MountTable::npos) return true;
+
+  // Parents of mounts that could not go, which are skipped in turn
+  vector<bool> blocked(table.slots(), false);
+  bool done = false;
+  table.postOrder(top, [&](const ProcMountInfo &mnt) {
+    auto index = table.indexOf(mnt);
+    if (!blocked[index]) {
+      if (!umount(string(mnt.mount_point))) {
+        done = index == top;
+        return;
+      }
+      if (errno == EBUSY) {
+        busy.emplace_back(mnt.mount_point);
+      } else {
+        cerr << "Failed to umount " << mnt.mount_point << " " << strerror(errno) << endl;
+      }
+    }
+    if (mnt.parent != MountTable::npos) blocked[mnt.parent] = true;
+  });
+  if (done) return true;
+
+  if (lazy && umountRecursive(root)) {
+    cerr << "Failed to detach " << root << " " << strerror(errno) << endl;
+    return false;
+  }
+  return lazy;
+}
+
+Fd &Fd::operator =(Fd &&o) {
+  if (this != &o) {
+    if (fd_ >= 0) close(fd_);
+    fd_ = o.release();
+  }
+  return *this;
+}
+
+Fd::~Fd() {
+  if (fd_ >= 0) close(fd_);
+}
+
+// Paths inside the tree are relative to its root fd
+static string relative(const string &path) {
+  auto pos = path.find_first_not_of('/');
+  return pos == string::npos ? "." : path.substr(pos);
+}
+
+Fd newMount(const string &fs, const string &source, const DetachedTree::TParams &params) {
+  TraceSpan span("syscall", "fsmount");
+  span.arg("fs", fs);
+  if (verbose) {
+    cerr << "fsopen(" << fs << ", " << source;
+    for (auto &p : params) cerr << ", " << p.first << "=" << p.second;
+    cerr << ")" << endl;
+  }
+  Fd fsfd(fsopen(fs.c_str(), FSOPEN_CLOEXEC));
+  if (!fsfd) {
+    cerr << "Failed to fsopen " << fs << " " << strerror(errno) << endl;
+    return Fd();
+  }
+  if (fsconfig(fsfd.get(), FSCONFIG_SET_STRING, "source", source.c_str(), 0)) {
+    cerr << "Failed to set " << fs << " source " << source << " " << strerror(errno) << endl;
+    return Fd();
+  }
+  for (auto &p : params) {
+    int ret = p.second.empty()
+      ? fsconfig(fsfd.get(), FSCONFIG_SET_FLAG, p.first.c_str(), nullptr, 0)
+      : fsconfig(fsfd.get(), FSCONFIG_SET_STRING, p.first.c_str(), p.second.c_str(), 0);
+    if (ret) {
+      cerr << "Failed to set " << fs << " option " << p.first << "=" << p.second << " " << strerror(errno) << endl;
+      return Fd();
+    }
+  }
+  if (fsconfig(fsfd.get(), FSCONFIG_CMD_CREATE, nullptr, nullptr, 0)) {
+    cerr << "Failed to create " << fs << " " << strerror(errno) << endl;
+    return Fd();
+  }
+  Fd mnt(fsmount(fsfd.get(), FSMOUNT_CLOEXEC, 0));
+  if (!mnt) {
+    cerr << "Failed to fsmount " << fs << " " << strerror(errno) << endl;
+  }
+  return mnt;
+}
+
+bool supportsLowerdirAppend() {
+  static const bool supported = [] {
+    Fd fsfd(fsopen("overlay", FSOPEN_CLOEXEC));
+    return fsfd && !fsconfig(fsfd.get(), FSCONFIG_SET_STRING, "lowerdir+", "/", 0);
+  }();
+  return supported;
+}
+
+bool supportsDetachedUpper() {
+  static const bool supported = [] {
+    struct utsname uts;
+    unsigned major, minor;
+    if (uname(&uts) || sscanf(uts.release, "%u.%u", &major, &minor) != 2) return false;
+    return major > 6 || (major == 6 && minor >= 15);
+  }();
+  return supported;
+}
+
+bool isMountPoint(const fs::path &path) {
+  struct statx stx;
+  if (statx(AT_FDCWD, path.c_str(), AT_NO_AUTOMOUNT, 0, &stx)) return false;
+  return stx.stx_attributes_mask & stx.stx_attributes & STATX_ATTR_MOUNT_ROOT;
+}
+
+Fd openUnderlying(const fs::path &path) {
+  auto parent = path.parent_path();
+  TraceSpan span("syscall", "open_tree");
+  span.arg("source", parent);
+  if (verbose)
+    cerr << "open_tree(" << parent << ")" << endl;
+  Fd mnt(open_tree(AT_FDCWD, parent.c_str(), OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC));
+  if (!mnt) cerr << "Failed to clone " << parent << " " << strerror(errno) << endl;
+  return mnt;
+}
+
+Fd cloneTree(const string &src, bool recursive, uint64_t attr) {
+  unsigned int recurse = recursive ? AT_RECURSIVE : 0;
+  TraceSpan span("syscall", "open_tree");
+  span.arg("source", src);
+  if (verbose)
+    cerr << "open_tree(" << src << (recursive ? ", AT_RECURSIVE" : "") << ")" << endl;
+  Fd mnt(open_tree(AT_FDCWD, src.c_str(), OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | recurse));
+  if (!mnt) {
+    cerr << "Failed to clone " << src << " " << strerror(errno) << endl;
+    return mnt;
+  }
+  if (!attr) return mnt;
+  struct mount_attr mattr = {};
+  mattr.attr_set = attr;
+  if (verbose)
+    cerr << "mount_setattr(" << mnt.get() << ", " << attr << ")" << endl;
+  if (mount_setattr(mnt.get(), "", AT_EMPTY_PATH | recurse, &mattr, sizeof(mattr))) {
+    cerr << "Failed to set mount attributes on " << src << " " << strerror(errno) << endl;
+    return Fd();
+  }
+  return mnt;
+}
+
+bool bindTree(const string &src, const string &dst, bool recursive, uint64_t attr) {
+  auto mnt = cloneTree(src, recursive, attr);
+  return mnt && attachMount(mnt, dst);
+}
+
+bool attachMount(const Fd &mnt, const string &dst) {
+  TraceSpan span("syscall", "move_mount");
+  span.arg("target", dst);
+  if (verbose)
+    cerr << "move_mount(" << mnt.get() << ", " << dst << ")" << endl;
+  if (move_mount(mnt.get(), "", AT_FDCWD, dst.c_str(), MOVE_MOUNT_F_EMPTY_PATH)) {
+    cerr << "Failed to move mount to " << dst << " " << strerror(errno) << endl;
+    return false;
+  }
+  return true;
+}
+
+bool DetachedTree::create(const string &fs, const string &source, const TParams &params, const fs::path &target) {
+  root_ = newMount(fs, source, params);
+  target_ = target;
+  attached_ = false;
+  return !!root_;
+}
+
+bool DetachedTree::mountFs(const string &fs, const string &source, const TParams &params, const string &path) {
+  auto mnt = newMount(fs, source, params);
+  if (!mnt) return false;
+  return graft(move(mnt), path);
+}
+
+bool DetachedTree::bind(const string &src, const string &path, bool recursive, uint64_t attr) {
+  auto mnt = cloneTree(src, recursive, attr);
+  if (!mnt) return false;
+  return graft(move(mnt), path);
+}
+
+bool DetachedTree::graft(Fd mnt, const string &path) {
+  auto rel = relative(path);
+  TraceSpan span("syscall", "move_mount");
+  span.arg("target", path);
+  if (verbose)
+    cerr << "move_mount(" << mnt.get() << ", " << target_ << " / " << rel << ")" << endl;
+  if (!move_mount(mnt.get(), "", root_.get(), rel.c_str(), MOVE_MOUNT_F_EMPTY_PATH)) return true;
+  if (errno != EINVAL || attached_) {
+    cerr << "Failed to move mount to " << path << " " << strerror(errno) << endl;
+    return false;
+  }
+  if (!attach()) return false;
+  if (!move_mount(mnt.get(), "", root_.get(), rel.c_str(), MOVE_MOUNT_F_EMPTY_PATH)) return true;
+  cerr << "Failed to move mount to " << path << " " << strerror(errno) << endl;
+  return false;
+}
+
+bool DetachedTree::isDirectory(const string &path) const {
+  struct stat st;
+  if (fstatat(root_.get(), relative(path).c_str(), &st, 0)) return false;
+  return S_ISDIR(st.st_mode);
+}
+
+bool DetachedTree::createDirectory(const string &path) const {
+  if (!mkdirat(root_.get(), relative(path).c_str(), 0755) || errno == EEXIST) return true;
+  cerr << "Failed to create " << path << " " << strerror(errno) << endl;
+  return false;
+}
+
+bool DetachedTree::attach() {
+  if (attached_) return true;
+  TraceSpan span("syscall", "move_mount");
+  span.arg("target", target_);
+  if (verbose)
+    cerr << "move_mount(" << root_.get() << ", " << target_ << ")" << endl;
+  if (move_mount(root_.get(), "", AT_FDCWD, target_.c_str(), MOVE_MOUNT_F_EMPTY_PATH)) {
+    cerr << "Failed to attach " << target_ << " " << strerror(errno) << endl;
+    return false;
+  }
+  attached_ = true;
+  return true;
+}
+
+} // namespace
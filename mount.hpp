@@ -0,0 +1,104 @@
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <filesystem>
+
+#pragma once
+
+namespace chroot_venv {
+
+extern bool verbose;
+
+int mount(std::string src, std::string dst, std::string fs, int flags, std::string opts);
+int umount(std::string dst);
+// Lazily detaches dst together with every mount below it
+int umountRecursive(std::string dst);
+
+// Unmounts the tree of mounts at root, children before parents, in a single
+// pass over one snapshot of that subtree. Busy mounts are appended to busy
+// and skipped along with their ancestors. With lazy, whatever is left is
+// then released by one umountRecursive() of root rather than waited for.
+// Returns true once nothing is left mounted at root.
+bool umountTree(const std::string &root, bool lazy, std::vector<std::string> &busy);
+
+// Owns a file descriptor, closing it when destroyed
+class Fd {
+  int fd_ = -1;
+public:
+  Fd() = default;
+  explicit Fd(int fd) : fd_(fd) {}
+  Fd(const Fd &) = delete;
+  Fd(Fd &&o) : fd_(o.release()) {}
+  Fd &operator =(const Fd &) = delete;
+  Fd &operator =(Fd &&o);
+  ~Fd();
+
+  int get() const { return fd_; }
+  explicit operator bool() const { return fd_ >= 0; }
+  int release() { return std::exchange(fd_, -1); }
+};
+
+// Whether path is the root of a mount
+bool isMountPoint(const std::filesystem::path &path);
+// Opens the parent of path through a clone of just the mount it is on, in
+// which path shows the directory underneath anything mounted there
+Fd openUnderlying(const std::filesystem::path &path);
+
+// Whether overlayfs takes lower layers one at a time through fsconfig()
+// "lowerdir+", which Linux 6.8 added. Each layer is then its own option, so
+// the stack is not limited by the size of a single lowerdir= string.
+bool supportsLowerdirAppend();
+// Whether overlayfs takes its upper and work directories on a mount that
+// is not attached anywhere, which clone_private_mount() refuses before
+// Linux 6.15
+bool supportsDetachedUpper();
+
+// Clones the mount at src, or with recursive the whole tree below it, and
+// applies the MOUNT_ATTR_* flags in attr to every cloned mount in one call
+Fd cloneTree(const std::string &src, bool recursive, uint64_t attr);
+// Clones src as above and attaches it at dst
+bool bindTree(const std::string &src, const std::string &dst, bool recursive, uint64_t attr);
+// Attaches the detached mount mnt at dst
+bool attachMount(const Fd &mnt, const std::string &dst);
+
+// A mount tree assembled with fsopen()/fsmount()/open_tree() while detached
+// from the filesystem. Children are grafted on with fd-relative move_mount()
+// calls, and the whole tree is attached with one final move_mount(). Until
+// then a failure only has to close file descriptors.
+//
+// Kernels before 6.15 refuse to graft onto a detached mount, in which case
+// the root is attached first and the remaining children grafted onto it in
+// place, still relative to its fd.
+class DetachedTree {
+  Fd root_;
+  std::filesystem::path target_;
+  bool attached_ = false;
+
+public:
+  using TParams = std::vector<std::pair<std::string, std::string>>;
+
+  // Creates the root filesystem of the tree, to be attached at target, see
+  // newMount
+  bool create(const std::string &fs, const std::string &source, const TParams &params, const std::filesystem::path &target);
+
+  // Mounts a new instance of fs at path, relative to the tree root
+  bool mountFs(const std::string &fs, const std::string &source, const TParams &params, const std::string &path);
+  // Clones the mount at src onto path, relative to the tree root, see cloneTree
+  bool bind(const std::string &src, const std::string &path, bool recursive = false, uint64_t attr = 0);
+  bool graft(Fd mnt, const std::string &path);
+
+  // Directory helpers relative to the tree root
+  bool isDirectory(const std::string &path) const;
+  bool createDirectory(const std::string &path) const;
+
+  bool attach();
+  bool attached() const { return attached_; }
+};
+
+// Creates a detached mount of a new instance of fs. Params with an empty
+// value are set as flags.
+Fd newMount(const std::string &fs, const std::string &source, const DetachedTree::TParams &params);
+
+} // namespace
@@ -0,0 +1,203 @@
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "procmounts.hpp"
+
+// Benchmarks the procmounts parsers and MountTable lookups against synthetic
+// mountinfo and mounts files, so it runs unprivileged on any build box.
+// Aborts first if a MountWatcher regression check fails.
+//
+//   procmounts_bench [max-entries] [work-dir]
+
+using namespace std;
+namespace fs = std::filesystem;
+using namespace procmounts;
+
+static atomic<size_t> allocations = 0;
+
+// Counting replacements for the global allocator. GCC cannot see that these
+// pair up once inlined into library code.
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void *operator new(size_t size) {
+  ++allocations;
+  if (void *ptr = malloc(size ? size : 1)) return ptr;
+  throw bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+  free(ptr);
+}
+
+enum class Shape {
+  WIDE,
+  DEEP,
+  TREE,
+};
+
+static const char *shapeName(Shape shape) {
+  switch (shape) {
+    case Shape::WIDE: return "wide";
+    case Shape::DEEP: return "deep";
+    case Shape::TREE: return "tree";
+  }
+  return "";
+}
+
+// Paths use the kernel's escaping for spaces and tabs, and every mount
+// carries the full set of optional fields.
+static string mountPoint(const vector<string> &points, size_t parent, size_t i) {
+  string parent_point = points[parent] == "/" ? "" : points[parent];
+  return parent_point + "/mnt\\040" + to_string(i) + (i % 7 ? "" : "\\011tab");
+}
+
+static void generate(Shape shape, size_t count, const fs::path &mountinfo, const fs::path &mounts) {
+  mt19937 rng(count);
+  ofstream info(mountinfo);
+  ofstream mtab(mounts);
+  vector<string> points = { "/" };
+  info << "1 0 8:1 / / rw,relatime shared:1 - ext4 /dev/sda1 rw\n";
+  mtab << "/dev/sda1 / ext4 rw,relatime 0 0\n";
+  for (size_t i = 1; i < count; ++i) {
+    size_t parent = 0;
+    switch (shape) {
+      case Shape::WIDE: parent = 0; break;
+      case Shape::DEEP: parent = i - 1; break;
+      case Shape::TREE: parent = uniform_int_distribution<size_t>(0, i - 1)(rng); break;
+    }
+    // Deep chains would otherwise grow paths quadratically
+    if (shape == Shape::DEEP && points[parent].size() > 2048) parent = 0;
+    points.push_back(mountPoint(points, parent, i));
+    auto &point = points.back();
+    info
+      << i + 1 << " " << parent + 1 << " 0:" << i << " / " << point
+      << " rw,nosuid,nodev,relatime shared:" << i << " master:" << parent + 1
+      << " propagate_from:" << parent + 1 << (i % 3 ? "" : " unbindable")
+      << " - overlay build\\040root" << i
+      << " rw,lowerdir=/lower/" << i << ",upperdir=/upper/" << i << ",workdir=/work/" << i << "\n";
+    mtab
+      << "build\\040root" << i << " " << point
+      << " overlay rw,nosuid,nodev,relatime,lowerdir=/lower/" << i
+      << ",upperdir=/upper/" << i << ",workdir=/work/" << i << " 0 0\n";
+  }
+}
+
+template<typename TFn>
+static void measure(Shape shape, size_t count, const char *name, TFn fn) {
+  using clock = chrono::steady_clock;
+  size_t iterations = max<size_t>(1, 200000 / count);
+  fn();
+  auto allocs = allocations.load();
+  auto start = clock::now();
+  for (size_t i = 0; i < iterations; ++i) fn();
+  auto elapsed = chrono::duration<double, micro>(clock::now() - start).count();
+  allocs = allocations.load() - allocs;
+  cout
+    << left << setw(6) << shapeName(shape)
+    << right << setw(8) << count << "  "
+    << left << setw(20) << name
+    << right << setw(14) << fixed << setprecision(2) << elapsed / iterations << " us"
+    << setw(12) << allocs / iterations << " allocs" << endl;
+}
+
+static void run(Shape shape, size_t count, const fs::path &dir) {
+  auto mountinfo = dir / "mountinfo";
+  auto mounts = dir / "mounts";
+  generate(shape, count, mountinfo, mounts);
+
+  measure(shape, count, "ProcMount::read", [&] {
+    auto table = ProcMount::read(mounts);
+    if (table.size() != count) abort();
+  });
+  measure(shape, count, "MountTable::read", [&] {
+    auto table = MountTable::read(mountinfo);
+    if (table.size() != count) abort();
+  });
+
+  auto table = MountTable::read(mountinfo);
+  auto last = string(table[table.size() - 1].mount_point);
+  measure(shape, count, "recursiveChildren", [&] {
+    if (table.recursiveChildren(table.root()).size() != count - 1) abort();
+  });
+  measure(shape, count, "preOrder", [&] {
+    size_t seen = 0;
+    table.preOrder(table.root(), [&](auto &) { ++seen; });
+    if (seen != count) abort();
+  });
+  measure(shape, count, "postOrder", [&] {
+    size_t seen = 0;
+    table.postOrder(table.root(), [&](auto &) { ++seen; });
+    if (seen != count) abort();
+  });
+  measure(shape, count, "findMountPoint cold", [&] {
+    auto copy = MountTable::read(mountinfo);
+    if (copy.findMountPoint(last) == MountTable::npos) abort();
+  });
+  measure(shape, count, "findMountPoint", [&] {
+    if (table.findMountPoint(last) == MountTable::npos) abort();
+  });
+  measure(shape, count, "findOverlayDir", [&] {
+    if (table.findOverlayDir("/upper/1") == MountTable::npos) abort();
+  });
+  measure(shape, count, "by", [&] {
+    if (table.byPtr<&ProcMountInfo::mount_point>(table.root()).size() != count - 1) abort();
+  });
+  measure(shape, count, "anyOf", [&] {
+    if (table.anyOf([](auto &mnt) { return mnt.filesystem == "nfs"; }, table.root())) abort();
+  });
+}
+
+// MountWatcher regression: a mount moved under a mount that appears in the
+// same update must stay reachable from the root.
+static void checkWatcher(const fs::path &dir) {
+  auto mountinfo = dir / "watched";
+  ofstream(mountinfo)
+    << "1 0 8:1 / / rw - ext4 /dev/sda1 rw\n"
+    << "2 1 0:2 / /a rw - tmpfs tmpfs rw\n";
+  MountWatcher watcher(mountinfo);
+  ofstream(mountinfo)
+    << "1 0 8:1 / / rw - ext4 /dev/sda1 rw\n"
+    << "3 1 0:3 / /b rw - tmpfs tmpfs rw\n"
+    << "2 3 0:2 / /b/a rw - tmpfs tmpfs rw\n";
+  watcher.update();
+
+  auto &table = watcher.table();
+  size_t seen = 0;
+  table.preOrder(table.root(), [&](auto &) { ++seen; });
+  if (seen != 3) {
+    cerr << "MountWatcher: moved mount orphaned, reached " << seen << " of 3" << endl;
+    abort();
+  }
+}
+
+int main(int argc, const char *argv[]) {
+  size_t max_count = argc > 1 ? stoul(argv[1]) : 100000;
+  fs::path dir = argc > 2 ? fs::path(argv[2]) : fs::temp_directory_path() / ("procmounts_bench." + to_string(getpid()));
+  fs::create_directories(dir);
+
+  checkWatcher(dir);
+
+  for (auto shape : { Shape::WIDE, Shape::DEEP, Shape::TREE }) {
+    for (size_t count = 100; count <= max_count; count *= 10) {
+      run(shape, count, dir);
+    }
+  }
+
+  if (argc <= 2) fs::remove_all(dir);
+  return 0;
+}
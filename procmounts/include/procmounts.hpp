@@ -1,9 +1,14 @@
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <optional>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <type_traits>
 
 #pragma once
 
@@ -12,69 +17,237 @@ namespace procmounts {
 struct ProcMount {
   using TVec = std::vector<ProcMount>;
   using TMap  = std::map<std::string, ProcMount>;
-  std::string mnt_fsname;
-  std::string mnt_dir;
-  std::string mnt_type;
-  std::string mnt_opts;
+  std::string_view mnt_fsname;
+  std::string_view mnt_dir;
+  std::string_view mnt_type;
+  std::string_view mnt_opts;
   int mnt_freq;
   int mnt_passno;
+  // The fields above are unescaped views into this buffer
+  std::shared_ptr<const std::string> buffer;
 
   static const TVec read(std::string path = "/proc/self/mounts");
   static const TMap by(const TVec &mounts, std::function<std::string(const ProcMount &)> fn);
 
-  template<std::string ProcMount::*ptr>
+  template<std::string_view ProcMount::*ptr>
   static const TMap byPtr(const TVec &mounts) {
-    return by(mounts, [](auto mnt) {
-      return mnt.*ptr;
+    return by(mounts, [](auto &mnt) {
+      return std::string(mnt.*ptr);
     });
   }
 
   static bool any_of(const TVec &mounts, std::function<bool(const ProcMount &)> fn);
 };
 
-struct ProcMountInfo : std::enable_shared_from_this<ProcMountInfo> {
-  using TShared = std::shared_ptr<ProcMountInfo>;
-  using TWeak = std::weak_ptr<ProcMountInfo>;
-  using TSharedConst = std::shared_ptr<const ProcMountInfo>;
-  using TVec = std::vector<TShared>;
-  template<typename TKey>
-  using TMap  = std::map<TKey, TShared>;
-
-  size_t mount_id;
-  size_t parent_id;
-  std::string major_minor;
-  std::string root;
-  std::string mount_point;
-  std::string options;
-  std::map<std::string, std::string> optional_fields;
+struct ProcMountInfo {
+  using TIndex = uint32_t;
+  static constexpr TIndex npos = ~TIndex(0);
+
+  // Ids as in mountinfo, or the kernel's 64-bit unique ids when the table
+  // came from MountTable::list()
+  uint64_t mount_id;
+  uint64_t parent_id;
+  std::string_view major_minor;
+  std::string_view root;
+  std::string_view mount_point;
+  std::string_view options;
+  // Space separated tag[:value] pairs, see optionalField()
+  std::string_view optional_fields;
   // separator
-  std::string filesystem;
-  std::string source;
-  std::string super_options;
-
-  TWeak parent;
-  TVec children;
-
-
-  static const TShared read(int pid);
-  static const TShared read(std::string path = "/proc/self/mountinfo");
+  std::string_view filesystem;
+  std::string_view source;
+  // Unescaped but for commas and backslashes, \054 and \134, so options
+  // still split on ','
+  std::string_view super_options;
+
+  // Links into the owning MountTable
+  TIndex parent = npos;
+  TIndex first_child = npos;
+  TIndex last_child = npos;
+  TIndex next_sibling = npos;
+
+  std::optional<std::string_view> optionalField(std::string_view key) const;
+};
 
-  TVec recursiveChildren() const;
-  TSharedConst findMountPoint(std::string find_mount_point) const;
-  TMap<std::string> by(std::function<std::string(const TShared &)> fn) const;
+// Every mount of a mountinfo file in one contiguous vector, linked into a tree
+// by index. The string fields of the entries are views into buffers owned by
+// the table, so entries must not outlive it.
+class MountTable {
+public:
+  using TIndex = ProcMountInfo::TIndex;
+  static constexpr TIndex npos = ProcMountInfo::npos;
+  template<typename TKey>
+  using TMap = std::map<TKey, TIndex>;
+  using TVec = std::vector<TIndex>;
+  using TMultiIndex = std::unordered_multimap<std::string_view, TIndex>;
+
+  static MountTable read(int pid);
+  static MountTable read(std::string path = "/proc/self/mountinfo");
+
+  // Queries the kernel with listmount(2)/statmount(2) where available
+  // (Linux 6.8+), otherwise falls back to read().
+  static MountTable list();
+  // The mount at mount_point and everything below it, with that mount as
+  // root(). Costs a few syscalls per mount in the subtree rather than a scan
+  // of every mount on the host. root() is npos if nothing is mounted there.
+  static MountTable listSubtree(const std::string &mount_point);
+  static bool haveListMount();
+
+  TIndex root() const { return root_; }
+  // Live mounts; slots freed by a MountWatcher update are reused later
+  size_t size() const { return mounts_.size() - free_.size(); }
+  bool empty() const { return size() == 0; }
+  // Number of slots, valid indexes are below this
+  size_t slots() const { return mounts_.size(); }
+  bool live(TIndex index) const { return mounts_[index].mount_id != FREE_ID; }
+  const ProcMountInfo &operator [](TIndex index) const { return mounts_[index]; }
+  TIndex indexOf(const ProcMountInfo &mnt) const { return &mnt - mounts_.data(); }
+
+  // Visit the subtree rooted at from, including from itself, without
+  // allocating. fn may return false to stop the walk early.
+  template<typename TFn>
+  void preOrder(TIndex from, TFn fn) const;
+  template<typename TFn>
+  void postOrder(TIndex from, TFn fn) const;
+
+  // Hash lookups, each index is built on first use and owned by the table.
+  // findMountPoint() returns the first mount at a path in pre-order, i.e. the
+  // one further mounts at the same path are stacked on.
+  TIndex findMountPoint(std::string_view find_mount_point) const;
+  TIndex findMountId(uint64_t mount_id) const;
+  std::pair<TMultiIndex::const_iterator, TMultiIndex::const_iterator> findMajorMinor(std::string_view major_minor) const;
+  std::pair<TMultiIndex::const_iterator, TMultiIndex::const_iterator> findSource(std::string_view source) const;
+  // Overlay mount using dir as its upperdir or workdir
+  TIndex findOverlayDir(std::string_view dir) const;
+
+  // The functions below cover the descendants of from, excluding from itself
+  TVec recursiveChildren(TIndex from) const;
+  TMap<std::string> by(std::function<std::string(const ProcMountInfo &)> fn, TIndex from) const;
+
+  template<std::string_view ProcMountInfo::*ptr>
+  TMap<std::string> byPtr(TIndex from) const {
+    return by([](auto &mnt) {
+      return std::string(mnt.*ptr);
+    }, from);
+  }
 
-  template<std::string ProcMountInfo::*ptr>
-  TMap<std::string> byPtr() const {
-    return by([](auto mnt) {
-      return mnt.*ptr;
-    });
+  bool anyOf(std::function<bool(const ProcMountInfo &)> fn, TIndex from) const;
+
+  std::ostream &print(std::ostream &os, TIndex from) const;
+
+private:
+  friend class MountWatcher;
+  static constexpr uint64_t FREE_ID = ~uint64_t(0);
+
+  std::vector<ProcMountInfo> mounts_;
+  std::vector<std::shared_ptr<const std::string>> buffers_;
+  TVec free_;
+  TIndex root_ = npos;
+  std::unordered_map<uint64_t, TIndex> by_mount_id_;
+  mutable std::optional<std::unordered_map<std::string_view, TIndex>> by_mount_point_;
+  mutable std::optional<TMultiIndex> by_major_minor_;
+  mutable std::optional<TMultiIndex> by_source_;
+  // Unescaped, so owning its keys
+  mutable std::optional<std::unordered_map<std::string, TIndex>> by_overlay_dir_;
+
+  static MountTable listFrom(uint64_t mnt_id, bool include_self);
+  static MountTable fromBuffer(std::shared_ptr<std::string> buffer, const std::string &path);
+  static bool parseLines(std::string &buffer, const std::string &path, std::vector<ProcMountInfo> &mounts);
+
+  // Incremental updates, see MountWatcher. insert() leaves the entry unlinked
+  // so a batch can be inserted before linking in any order.
+  TIndex insert(const ProcMountInfo &mnt);
+  void link(TIndex index);
+  void unlink(TIndex index);
+  void update(TIndex index, const ProcMountInfo &mnt);
+  void erase(TIndex index);
+  void addToIndexes(TIndex index) const;
+  void removeFromIndexes(TIndex index) const;
+  // Copy every live string into one fresh buffer and drop the old ones
+  void compact();
+
+  template<typename TFn>
+  static bool visit(TFn &fn, const ProcMountInfo &mnt) {
+    if constexpr (std::is_same_v<decltype(fn(mnt)), bool>) {
+      return fn(mnt);
+    } else {
+      fn(mnt);
+      return true;
+    }
   }
+};
 
-  bool anyOf(std::function<bool(const TShared &)> fn) const;
+template<typename TFn>
+void MountTable::preOrder(TIndex from, TFn fn) const {
+  if (from == npos) return;
+  TIndex i = from;
+  while (true) {
+    if (!visit(fn, mounts_[i])) return;
+    if (mounts_[i].first_child != npos) {
+      i = mounts_[i].first_child;
+      continue;
+    }
+    while (i != from && mounts_[i].next_sibling == npos) i = mounts_[i].parent;
+    if (i == from) return;
+    i = mounts_[i].next_sibling;
+  }
+}
+
+template<typename TFn>
+void MountTable::postOrder(TIndex from, TFn fn) const {
+  if (from == npos) return;
+  auto descend = [this](TIndex i) {
+    while (mounts_[i].first_child != npos) i = mounts_[i].first_child;
+    return i;
+  };
+  TIndex i = descend(from);
+  while (true) {
+    // Read the links before visiting so fn sees a stable entry
+    const auto &mnt = mounts_[i];
+    TIndex next = mnt.next_sibling != npos ? descend(mnt.next_sibling) : mnt.parent;
+    if (!visit(fn, mnt) || i == from) return;
+    i = next;
+  }
+}
+
+// Keeps a MountTable current by waiting for POLLPRI on mountinfo and applying
+// only the mounts added, removed or changed since the previous snapshot.
+class MountWatcher {
+public:
+  enum class Event {
+    ADDED,
+    REMOVED,
+    CHANGED,
+  };
+  // REMOVED is delivered while the entry is still in the table
+  using TCallback = std::function<void(Event, const MountTable &, MountTable::TIndex)>;
+
+  MountWatcher(std::string path = "/proc/self/mountinfo");
+  MountWatcher(const MountWatcher &) = delete;
+  MountWatcher &operator =(const MountWatcher &) = delete;
+  ~MountWatcher();
+
+  const MountTable &table() const { return table_; }
+  // For callers with their own poll loop: wait for POLLPRI then call update()
+  int fd() const { return fd_; }
+  void onEvent(TCallback cb) { callbacks_.push_back(std::move(cb)); }
+
+  // Waits up to timeout_ms (-1 forever) for a change and applies it.
+  // Returns the number of events delivered.
+  size_t wait(int timeout_ms = -1);
+  size_t update();
+
+private:
+  std::string path_;
+  int fd_ = -1;
+  MountTable table_;
+  std::vector<TCallback> callbacks_;
+  std::vector<uint32_t> seen_;
+  uint32_t generation_ = 0;
+
+  void emit(Event event, MountTable::TIndex index) const;
 };
 
-std::ostream &operator <<(std::ostream &os, const std::shared_ptr<ProcMountInfo> &o);
-std::ostream &operator <<(std::ostream &os, const std::shared_ptr<const ProcMountInfo> &o);
 std::ostream &operator <<(std::ostream &os, const ProcMountInfo &o);
 
 } // namespace
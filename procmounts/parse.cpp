@@ -0,0 +1,123 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include "parse.hpp"
+
+namespace procmounts::parse {
+
+using namespace std;
+
+// /proc files report a size of 0, so start with a buffer large enough for a
+// typical host in one read() and double it whenever it fills up.
+static const size_t INITIAL_READ_SIZE = 64 * 1024;
+
+shared_ptr<string> readFile(const string &path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw system_error(errno, generic_category(), "Failed to open " + path);
+  }
+  try {
+    auto buffer = readFd(fd, path);
+    close(fd);
+    return buffer;
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+}
+
+shared_ptr<string> readFd(int fd, const string &path) {
+  if (lseek(fd, 0, SEEK_SET) < 0) {
+    throw system_error(errno, generic_category(), "Failed to seek " + path);
+  }
+  auto buffer = make_shared<string>();
+  size_t used = 0;
+  buffer->resize(INITIAL_READ_SIZE);
+  while (true) {
+    if (used == buffer->size()) buffer->resize(buffer->size() * 2);
+    auto len = ::read(fd, buffer->data() + used, buffer->size() - used);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      throw system_error(errno, generic_category(), "Failed to read " + path);
+    }
+    if (len == 0) break;
+    used += len;
+  }
+  buffer->resize(used);
+  return buffer;
+}
+
+static inline bool isOctal(char c) {
+  return c >= '0' && c <= '7';
+}
+
+size_t unescape(char *begin, char *end, string_view keep) {
+  char *out = static_cast<char *>(memchr(begin, '\\', end - begin));
+  if (!out) return end - begin;
+  char *in = out;
+  while (in < end) {
+    if (*in == '\\' && end - in >= 4 && isOctal(in[1]) && isOctal(in[2]) && isOctal(in[3])) {
+      auto c = static_cast<char>(((in[1] - '0') << 6) | ((in[2] - '0') << 3) | (in[3] - '0'));
+      if (keep.find(c) != string_view::npos) {
+        out = copy(in, in + 4, out);
+      } else {
+        *out++ = c;
+      }
+      in += 4;
+    } else {
+      *out++ = *in++;
+    }
+  }
+  return out - begin;
+}
+
+Tokenizer::Tokenizer(string &buffer)
+  : pos_(buffer.data()), end_(buffer.data() + buffer.size()), eol_(pos_) {}
+
+bool Tokenizer::nextLine() {
+  pos_ = eol_;
+  while (pos_ < end_ && *pos_ == '\n') ++pos_;
+  if (pos_ >= end_) return false;
+  eol_ = static_cast<char *>(memchr(pos_, '\n', end_ - pos_));
+  if (!eol_) eol_ = end_;
+  return true;
+}
+
+bool Tokenizer::nextField(string_view &field, string_view keep) {
+  while (pos_ < eol_ && *pos_ == ' ') ++pos_;
+  if (pos_ >= eol_) return false;
+  char *start = pos_;
+  while (pos_ < eol_ && *pos_ != ' ') ++pos_;
+  field = string_view(start, unescape(start, pos_, keep));
+  return true;
+}
+
+bool Tokenizer::untilSeparator(string_view &fields) {
+  while (pos_ < eol_ && *pos_ == ' ') ++pos_;
+  char *start = pos_;
+  char *last = pos_;
+  string_view field;
+  while (nextField(field)) {
+    if (field == "-") {
+      fields = string_view(start, last - start);
+      return true;
+    }
+    // Optional fields are unescaped in place and may have shrunk, so close
+    // the gap to keep the run contiguous.
+    if (last != start) *last++ = ' ';
+    if (last != field.data()) memmove(last, field.data(), field.size());
+    last += field.size();
+  }
+  return false;
+}
+
+size_t countLines(const string &buffer) {
+  return count(buffer.cbegin(), buffer.cend(), '\n');
+}
+
+} // namespace
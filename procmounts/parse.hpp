@@ -0,0 +1,56 @@
+#include <charconv>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#pragma once
+
+namespace procmounts::parse {
+
+// Reads the whole of path into one buffer with as few large read() calls as
+// the kernel allows. Throws std::system_error if the file cannot be read.
+std::shared_ptr<std::string> readFile(const std::string &path);
+// As readFile() but from the start of an already open fd, which stays open.
+// path is only used for error messages.
+std::shared_ptr<std::string> readFd(int fd, const std::string &path);
+
+// Decodes the kernel's octal escapes (\040, \011, \012, \134, ...) in place
+// and returns the new length of the decoded field. Escapes of the characters
+// in keep are left as they are.
+size_t unescape(char *begin, char *end, std::string_view keep = {});
+// What ProcMountInfo::super_options keeps escaped
+constexpr std::string_view SUPER_OPTIONS_ESCAPED = ",\\";
+
+// Splits a buffer into lines and whitespace separated fields in place. Fields
+// are unescaped as they are handed out, so views stay valid for as long as the
+// buffer does and nothing is copied.
+class Tokenizer {
+  char *pos_;
+  char *end_;
+  char *eol_;
+public:
+  Tokenizer(std::string &buffer);
+
+  // Advances to the next non-empty line, false at end of buffer.
+  bool nextLine();
+  // Next field on the current line, false if the line is exhausted. See
+  // unescape() for keep.
+  bool nextField(std::string_view &field, std::string_view keep = {});
+  // Remainder of the current line up to (not including) the field "-".
+  // Used for the variable length optional fields of mountinfo.
+  bool untilSeparator(std::string_view &fields);
+  template<typename TNum>
+  bool nextNumber(TNum &num);
+};
+
+template<typename TNum>
+bool Tokenizer::nextNumber(TNum &num) {
+  std::string_view field;
+  if (!nextField(field)) return false;
+  auto res = std::from_chars(field.data(), field.data() + field.size(), num);
+  return res.ec == std::errc() && res.ptr == field.data() + field.size();
+}
+
+size_t countLines(const std::string &buffer);
+
+} // namespace
@@ -1,36 +1,34 @@
-#include <fstream>
-#include <sstream>
+#include <algorithm>
 #include <iostream>
+#include <unordered_map>
 
 #include "procmounts.hpp"
+#include "parse.hpp"
 
 namespace procmounts {
 
 using namespace std;
 
-istream &operator >>(istream &is, ProcMount &o) {
-  is >> o.mnt_fsname;
-  is >> o.mnt_dir;
-  is >> o.mnt_type;
-  is >> o.mnt_opts;
-  is >> o.mnt_freq;
-  is >> o.mnt_passno;
-  return is;
-}
-
 const vector<ProcMount> ProcMount::read(std::string path) {
   vector<ProcMount> ret;
-  ifstream file;
-  file.open(path);
-  file.exceptions(ifstream::failbit | ifstream::eofbit);
-  while (! file.eof()) {
-    try {
-      ProcMount mnt;
-      file >> mnt;
-      ret.push_back(mnt);
-    } catch (ifstream::failure &e) {
-      break;
+  auto buffer = parse::readFile(path);
+  ret.reserve(parse::countLines(*buffer));
+  parse::Tokenizer tok(*buffer);
+  while (tok.nextLine()) {
+    ProcMount mnt;
+    if (
+      !tok.nextField(mnt.mnt_fsname) ||
+      !tok.nextField(mnt.mnt_dir) ||
+      !tok.nextField(mnt.mnt_type) ||
+      !tok.nextField(mnt.mnt_opts) ||
+      !tok.nextNumber(mnt.mnt_freq) ||
+      !tok.nextNumber(mnt.mnt_passno)
+    ) {
+      cerr << "Skipping malformed line in " << path << endl;
+      continue;
     }
+    mnt.buffer = buffer;
+    ret.push_back(move(mnt));
   }
   return ret;
 }
@@ -47,115 +45,362 @@ bool ProcMount::any_of(const std::vector<ProcMount> &mounts, std::function<bool(
   return std::any_of(mounts.cbegin(), mounts.cend(), fn);
 }
 
-istream &operator >>(istream &is, ProcMountInfo &o) {
-  is >> o.mount_id;
-  is >> o.parent_id;
-  is >> o.major_minor;
-  is >> o.root;
-  is >> o.mount_point;
-  is >> o.options;
-  std::string field;
-  is >> field;
-  while (field != "-") {
-    auto separator = field.find(':');
-    string key = field.substr(0, separator);
-    string val = separator == string::npos ? "" : field.substr(separator + 1);
-    o.optional_fields[key] = val;
-    is >> field;
-  }
-  is >> o.filesystem;
-  is >> o.source;
-  is >> o.super_options;
-  return is;
+static bool parseMountInfo(parse::Tokenizer &tok, ProcMountInfo &o) {
+  return
+    tok.nextNumber(o.mount_id) &&
+    tok.nextNumber(o.parent_id) &&
+    tok.nextField(o.major_minor) &&
+    tok.nextField(o.root) &&
+    tok.nextField(o.mount_point) &&
+    tok.nextField(o.options) &&
+    tok.untilSeparator(o.optional_fields) &&
+    tok.nextField(o.filesystem) &&
+    tok.nextField(o.source) &&
+    tok.nextField(o.super_options, parse::SUPER_OPTIONS_ESCAPED);
 }
 
-const ProcMountInfo::TShared ProcMountInfo::read(int pid) {
+MountTable MountTable::read(int pid) {
   string path = "/proc/" + to_string(pid) + "/mountinfo";
   return read(path);
 }
 
-const ProcMountInfo::TShared ProcMountInfo::read(std::string path) {
-  TMap<size_t> mounts;
+MountTable MountTable::read(std::string path) {
+  return fromBuffer(parse::readFile(path), path);
+}
 
-  ifstream file;
-  file.open(path);
-  file.exceptions(ifstream::failbit | ifstream::eofbit);
-  while (! file.eof()) {
-    try {
-      auto mnt = make_shared<ProcMountInfo>();;
-      file >> *mnt;
-      mounts.insert({ mnt->mount_id, mnt });
-    } catch (ifstream::failure &e) {
-      break;
+bool MountTable::parseLines(string &buffer, const string &path, vector<ProcMountInfo> &mounts) {
+  mounts.reserve(mounts.size() + parse::countLines(buffer));
+  bool ok = true;
+  parse::Tokenizer tok(buffer);
+  while (tok.nextLine()) {
+    ProcMountInfo mnt;
+    if (!parseMountInfo(tok, mnt)) {
+      cerr << "Skipping malformed line in " << path << endl;
+      ok = false;
+      continue;
     }
+    mounts.push_back(mnt);
+  }
+  return ok;
+}
+
+MountTable MountTable::fromBuffer(shared_ptr<string> buffer, const string &path) {
+  MountTable table;
+  parseLines(*buffer, path, table.mounts_);
+  table.buffers_.push_back(buffer);
+
+  table.by_mount_id_.reserve(table.mounts_.size());
+  for (TIndex i = 0; i < table.mounts_.size(); ++i) {
+    table.by_mount_id_.emplace(table.mounts_[i].mount_id, i);
+  }
+  for (TIndex i = 0; i < table.mounts_.size(); ++i) {
+    table.link(i);
   }
+  if (table.root_ == npos) {
+    cerr << "No root found" << endl;
+  }
+  return table;
+}
+
+MountTable::TIndex MountTable::insert(const ProcMountInfo &mnt) {
+  TIndex index;
+  if (free_.empty()) {
+    index = mounts_.size();
+    mounts_.push_back(mnt);
+  } else {
+    index = free_.back();
+    free_.pop_back();
+    mounts_[index] = mnt;
+  }
+  auto &entry = mounts_[index];
+  entry.parent = entry.first_child = entry.last_child = entry.next_sibling = npos;
+  by_mount_id_[entry.mount_id] = index;
+  addToIndexes(index);
+  return index;
+}
 
-  TShared root;
-  for (auto it = mounts.cbegin(); it != mounts.cend(); ++it) {
-    auto p = *it;
-    auto mnt_ptr = p.second;
-    auto id = p.first;
-    auto parent_id = mnt_ptr->parent_id;
-    if (mounts.contains(parent_id)) {
-      auto parent_ptr = mounts.at(parent_id);
-      parent_ptr->children.push_back(mnt_ptr);
-      mnt_ptr->parent = parent_ptr;
+void MountTable::link(TIndex index) {
+  auto &mnt = mounts_[index];
+  auto parent = findMountId(mnt.parent_id);
+  if (parent != npos && parent != index) {
+    auto &parent_mnt = mounts_[parent];
+    mnt.parent = parent;
+    mnt.next_sibling = npos;
+    if (parent_mnt.last_child == npos) {
+      parent_mnt.first_child = index;
     } else {
-      if (root) {
-        cerr << "Multiple roots found " << root->mount_id << " " << mnt_ptr->mount_id << endl;
-      }
-      root = mnt_ptr;
+      mounts_[parent_mnt.last_child].next_sibling = index;
     }
+    parent_mnt.last_child = index;
+  } else if (root_ == npos || root_ == index) {
+    root_ = index;
+  } else {
+    cerr << "Multiple roots found " << mounts_[root_].mount_id << " " << mnt.mount_id << endl;
   }
-  if (!root) {
-    cerr << "No root found" << endl;
+}
+
+void MountTable::unlink(TIndex index) {
+  auto &mnt = mounts_[index];
+  if (mnt.parent == npos) {
+    if (root_ == index) root_ = npos;
+    return;
   }
-  return root;
+  auto &parent_mnt = mounts_[mnt.parent];
+  TIndex prev = npos;
+  for (TIndex i = parent_mnt.first_child; i != index; i = mounts_[i].next_sibling) prev = i;
+  if (prev == npos) {
+    parent_mnt.first_child = mnt.next_sibling;
+  } else {
+    mounts_[prev].next_sibling = mnt.next_sibling;
+  }
+  if (parent_mnt.last_child == index) parent_mnt.last_child = prev;
+  mnt.parent = mnt.next_sibling = npos;
 }
 
-ProcMountInfo::TVec ProcMountInfo::recursiveChildren() const {
-  TVec ret;
-  for (auto c : children) {
-    ret.push_back(c);
-    for (auto cc : c->recursiveChildren()) {
-      ret.push_back(cc);
+void MountTable::update(TIndex index, const ProcMountInfo &mnt) {
+  auto &entry = mounts_[index];
+  // Removing it from the indexes hands its path to a mount stacked on it,
+  // which a remount in place has to take back
+  bool owns_path = false;
+  if (by_mount_point_ && entry.mount_point == mnt.mount_point) {
+    auto it = by_mount_point_->find(entry.mount_point);
+    owns_path = it != by_mount_point_->end() && it->second == index;
+  }
+  removeFromIndexes(index);
+  bool moved = entry.parent_id != mnt.parent_id;
+  if (moved) unlink(index);
+  auto parent = entry.parent, first_child = entry.first_child;
+  auto last_child = entry.last_child, next_sibling = entry.next_sibling;
+  entry = mnt;
+  entry.parent = parent;
+  entry.first_child = first_child;
+  entry.last_child = last_child;
+  entry.next_sibling = next_sibling;
+  if (moved) link(index);
+  if (owns_path) by_mount_point_->erase(entry.mount_point);
+  addToIndexes(index);
+}
+
+void MountTable::erase(TIndex index) {
+  auto &mnt = mounts_[index];
+  removeFromIndexes(index);
+  unlink(index);
+  // The kernel drops children with their parent, but they may be erased
+  // after it within one update, so leave them detached rather than dangling
+  for (TIndex c = mnt.first_child; c != npos;) {
+    auto next = mounts_[c].next_sibling;
+    mounts_[c].parent = mounts_[c].next_sibling = npos;
+    c = next;
+  }
+  by_mount_id_.erase(mnt.mount_id);
+  mnt = ProcMountInfo();
+  mnt.mount_id = FREE_ID;
+  free_.push_back(index);
+}
+
+static void eraseFrom(MountTable::TMultiIndex &index, string_view key, MountTable::TIndex value) {
+  auto range = index.equal_range(key);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == value) {
+      index.erase(it);
+      return;
     }
   }
-  return ret;
 }
 
-ProcMountInfo::TSharedConst ProcMountInfo::findMountPoint(string find_mount_point) const {
-  if (mount_point == find_mount_point) return shared_from_this();
-  for (auto c : children) {
-    auto ret = c->findMountPoint(find_mount_point);
-    if (ret) return ret;
+template<typename TFn>
+static void forEachOverlayDir(const ProcMountInfo &mnt, TFn fn) {
+  if (mnt.filesystem != "overlay") return;
+  // Commas within an option are still escaped, so this splits them right
+  string_view opts = mnt.super_options;
+  while (!opts.empty()) {
+    auto end = opts.find(',');
+    auto opt = opts.substr(0, end);
+    opts = end == string_view::npos ? string_view() : opts.substr(end + 1);
+    for (string_view key : { "upperdir=", "workdir=" }) {
+      if (!opt.starts_with(key)) continue;
+      string dir(opt.substr(key.size()));
+      dir.resize(parse::unescape(dir.data(), dir.data() + dir.size()));
+      fn(dir);
+    }
   }
-  return nullptr;
 }
 
-ProcMountInfo::TMap<string> ProcMountInfo::by(std::function<string(const TShared &)> fn) const {
-  TMap<string> ret;
-  for (auto mnt : recursiveChildren()) {
-    ret[fn(mnt)] = mnt;
+void MountTable::addToIndexes(TIndex index) const {
+  auto &mnt = mounts_[index];
+  if (by_mount_point_) by_mount_point_->emplace(mnt.mount_point, index);
+  if (by_major_minor_) by_major_minor_->emplace(mnt.major_minor, index);
+  if (by_source_) by_source_->emplace(mnt.source, index);
+  if (by_overlay_dir_) {
+    forEachOverlayDir(mnt, [&](auto dir) { by_overlay_dir_->emplace(dir, index); });
+  }
+}
+
+void MountTable::removeFromIndexes(TIndex index) const {
+  auto &mnt = mounts_[index];
+  if (by_mount_point_) {
+    auto it = by_mount_point_->find(mnt.mount_point);
+    if (it != by_mount_point_->end() && it->second == index) {
+      // Hand the path over to a mount stacked on top of this one, if any
+      TIndex stacked = npos;
+      for (TIndex c = mnt.first_child; c != npos; c = mounts_[c].next_sibling) {
+        if (mounts_[c].mount_point == mnt.mount_point) {
+          stacked = c;
+          break;
+        }
+      }
+      if (stacked == npos) {
+        by_mount_point_->erase(it);
+      } else {
+        it->second = stacked;
+      }
+    }
+  }
+  if (by_major_minor_) eraseFrom(*by_major_minor_, mnt.major_minor, index);
+  if (by_source_) eraseFrom(*by_source_, mnt.source, index);
+  if (by_overlay_dir_) {
+    forEachOverlayDir(mnt, [&](auto dir) {
+      auto it = by_overlay_dir_->find(dir);
+      if (it != by_overlay_dir_->end() && it->second == index) by_overlay_dir_->erase(it);
+    });
   }
+}
+
+template<typename TMnt, typename TFn>
+static void forEachField(TMnt &mnt, TFn fn) {
+  fn(mnt.major_minor);
+  fn(mnt.root);
+  fn(mnt.mount_point);
+  fn(mnt.options);
+  fn(mnt.optional_fields);
+  fn(mnt.filesystem);
+  fn(mnt.source);
+  fn(mnt.super_options);
+}
+
+void MountTable::compact() {
+  size_t total = 0;
+  for (auto &mnt : mounts_) {
+    forEachField(mnt, [&](auto &field) { total += field.size(); });
+  }
+  auto buffer = make_shared<string>();
+  // Reserved up front so views into it stay put while it fills
+  buffer->reserve(total);
+  for (auto &mnt : mounts_) {
+    forEachField(mnt, [&](auto &field) {
+      auto pos = buffer->size();
+      buffer->append(field);
+      field = string_view(buffer->data() + pos, field.size());
+    });
+  }
+  buffers_ = { buffer };
+  // Keys of the lazy indexes pointed into the old buffers
+  by_mount_point_.reset();
+  by_major_minor_.reset();
+  by_source_.reset();
+  by_overlay_dir_.reset();
+}
+
+optional<string_view> ProcMountInfo::optionalField(string_view key) const {
+  string_view fields = optional_fields;
+  while (!fields.empty()) {
+    auto end = fields.find(' ');
+    auto field = fields.substr(0, end);
+    fields = end == string_view::npos ? string_view() : fields.substr(end + 1);
+    auto separator = field.find(':');
+    if (field.substr(0, separator) != key) continue;
+    return separator == string_view::npos ? string_view() : field.substr(separator + 1);
+  }
+  return nullopt;
+}
+
+MountTable::TVec MountTable::recursiveChildren(TIndex from) const {
+  TVec ret;
+  preOrder(from, [&](auto &mnt) {
+    if (&mnt != &mounts_[from]) ret.push_back(indexOf(mnt));
+  });
   return ret;
 }
 
-bool ProcMountInfo::anyOf(std::function<bool(const TShared &)> fn) const {
-  auto rec = recursiveChildren();
-  return std::any_of(rec.cbegin(), rec.cend(), [fn](auto it) {
-    return fn(it);
+MountTable::TIndex MountTable::findMountPoint(string_view find_mount_point) const {
+  if (!by_mount_point_) {
+    by_mount_point_.emplace();
+    by_mount_point_->reserve(mounts_.size());
+    preOrder(root_, [&](auto &mnt) {
+      by_mount_point_->emplace(mnt.mount_point, indexOf(mnt));
+    });
+  }
+  auto it = by_mount_point_->find(find_mount_point);
+  return it == by_mount_point_->end() ? npos : it->second;
+}
+
+MountTable::TIndex MountTable::findMountId(uint64_t mount_id) const {
+  auto it = by_mount_id_.find(mount_id);
+  return it == by_mount_id_.end() ? npos : it->second;
+}
+
+pair<MountTable::TMultiIndex::const_iterator, MountTable::TMultiIndex::const_iterator>
+MountTable::findMajorMinor(string_view major_minor) const {
+  if (!by_major_minor_) {
+    by_major_minor_.emplace();
+    by_major_minor_->reserve(mounts_.size());
+    preOrder(root_, [&](auto &mnt) {
+      by_major_minor_->emplace(mnt.major_minor, indexOf(mnt));
+    });
+  }
+  return by_major_minor_->equal_range(major_minor);
+}
+
+pair<MountTable::TMultiIndex::const_iterator, MountTable::TMultiIndex::const_iterator>
+MountTable::findSource(string_view source) const {
+  if (!by_source_) {
+    by_source_.emplace();
+    by_source_->reserve(mounts_.size());
+    preOrder(root_, [&](auto &mnt) {
+      by_source_->emplace(mnt.source, indexOf(mnt));
+    });
+  }
+  return by_source_->equal_range(source);
+}
+
+MountTable::TIndex MountTable::findOverlayDir(string_view dir) const {
+  if (!by_overlay_dir_) {
+    by_overlay_dir_.emplace();
+    preOrder(root_, [&](auto &mnt) {
+      forEachOverlayDir(mnt, [&](auto overlay_dir) { by_overlay_dir_->emplace(overlay_dir, indexOf(mnt)); });
+    });
+  }
+  auto it = by_overlay_dir_->find(string(dir));
+  return it == by_overlay_dir_->end() ? npos : it->second;
+}
+
+MountTable::TMap<string> MountTable::by(std::function<string(const ProcMountInfo &)> fn, TIndex from) const {
+  TMap<string> ret;
+  preOrder(from, [&](auto &mnt) {
+    if (&mnt != &mounts_[from]) ret[fn(mnt)] = indexOf(mnt);
   });
+  return ret;
 }
 
-std::ostream &operator <<(std::ostream &os, const shared_ptr<ProcMountInfo> &o) {
-  if (o) return os << *o;
-  return os << "Invalid pointer";
+bool MountTable::anyOf(std::function<bool(const ProcMountInfo &)> fn, TIndex from) const {
+  bool ret = false;
+  preOrder(from, [&](auto &mnt) {
+    if (&mnt != &mounts_[from] && fn(mnt)) ret = true;
+    return !ret;
+  });
+  return ret;
 }
 
-std::ostream &operator <<(std::ostream &os, const shared_ptr<const ProcMountInfo> &o) {
-  if (o) return os << *o;
-  return os << "Invalid pointer";
+std::ostream &MountTable::print(std::ostream &os, TIndex from) const {
+  if (from == npos) return os << "Invalid index";
+  bool first = true;
+  preOrder(from, [&](auto &mnt) {
+    if (!first) os << endl;
+    first = false;
+    for (TIndex p = indexOf(mnt); p != from; p = mounts_[p].parent) os << "  ";
+    os << mnt;
+  });
+  return os;
 }
 
 std::ostream &operator <<(std::ostream &os, const ProcMountInfo &o) {
@@ -168,25 +413,20 @@ std::ostream &operator <<(std::ostream &os, const ProcMountInfo &o) {
     << " options: " << o.options
     << " optional_fields: {";
 
-  for (auto &pair : o.optional_fields) {
-    os << " [" << pair.first << "=" << pair.second << "] ";
+  string_view fields = o.optional_fields;
+  while (!fields.empty()) {
+    auto end = fields.find(' ');
+    auto field = fields.substr(0, end);
+    fields = end == string_view::npos ? string_view() : fields.substr(end + 1);
+    auto separator = field.find(':');
+    os << " [" << field.substr(0, separator) << "="
+      << (separator == string_view::npos ? string_view() : field.substr(separator + 1)) << "] ";
   }
 
   os
     << "} filesystem: " << o.filesystem
     << " source: " << o.source
     << " super_options: " << o.super_options;
-  if (!o.children.empty()) {
-    os << endl << "children:";
-    stringstream ss_children;
-    for (auto child: o.children) {
-      ss_children << endl << child;
-    }
-    for (string line; getline(ss_children, line);) {
-      if (line.empty()) continue;
-      os << endl << "  " << line;
-    }
-  }
   return os;
 }
 
@@ -0,0 +1,363 @@
+#include <fcntl.h>
+#include <sys/mount.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+
+#include "parse.hpp"
+#include "procmounts.hpp"
+
+namespace procmounts {
+
+using namespace std;
+
+#ifndef SYS_statmount
+#define SYS_statmount 457
+#endif
+#ifndef SYS_listmount
+#define SYS_listmount 458
+#endif
+
+// Definitions from the Linux 6.8+ uapi headers, which the system headers may
+// predate. Only the parts used below are spelled out.
+namespace uapi {
+
+struct mnt_id_req {
+  uint32_t size;
+  uint32_t spare;
+  uint64_t mnt_id;
+  uint64_t param;
+};
+static const uint32_t MNT_ID_REQ_SIZE_VER0 = 24;
+
+struct statmount {
+  uint32_t size;
+  uint32_t mnt_opts;
+  uint64_t mask;
+  uint32_t sb_dev_major;
+  uint32_t sb_dev_minor;
+  uint64_t sb_magic;
+  uint32_t sb_flags;
+  uint32_t fs_type;
+  uint64_t mnt_id;
+  uint64_t mnt_parent_id;
+  uint32_t mnt_id_old;
+  uint32_t mnt_parent_id_old;
+  uint64_t mnt_attr;
+  uint64_t mnt_propagation;
+  uint64_t mnt_peer_group;
+  uint64_t mnt_master;
+  uint64_t propagate_from;
+  uint32_t mnt_root;
+  uint32_t mnt_point;
+  uint64_t mnt_ns_id;
+  uint32_t fs_subtype;
+  uint32_t sb_source;
+  uint64_t __spare2[48];
+  char str[];
+};
+
+static const uint64_t STATMOUNT_SB_BASIC = 0x1;
+static const uint64_t STATMOUNT_MNT_BASIC = 0x2;
+static const uint64_t STATMOUNT_PROPAGATE_FROM = 0x4;
+static const uint64_t STATMOUNT_MNT_ROOT = 0x8;
+static const uint64_t STATMOUNT_MNT_POINT = 0x10;
+static const uint64_t STATMOUNT_FS_TYPE = 0x20;
+static const uint64_t STATMOUNT_MNT_OPTS = 0x80;
+static const uint64_t STATMOUNT_SB_SOURCE = 0x200;
+
+static const uint64_t LSMT_ROOT = ~uint64_t(0);
+
+// glibc's struct statx does not expose stx_mnt_id yet
+struct statx_timestamp {
+  int64_t tv_sec;
+  uint32_t tv_nsec;
+  int32_t __reserved;
+};
+
+struct statx {
+  uint32_t stx_mask;
+  uint32_t stx_blksize;
+  uint64_t stx_attributes;
+  uint32_t stx_nlink;
+  uint32_t stx_uid;
+  uint32_t stx_gid;
+  uint16_t stx_mode;
+  uint16_t __spare0;
+  uint64_t stx_ino;
+  uint64_t stx_size;
+  uint64_t stx_blocks;
+  uint64_t stx_attributes_mask;
+  statx_timestamp stx_atime;
+  statx_timestamp stx_btime;
+  statx_timestamp stx_ctime;
+  statx_timestamp stx_mtime;
+  uint32_t stx_rdev_major;
+  uint32_t stx_rdev_minor;
+  uint32_t stx_dev_major;
+  uint32_t stx_dev_minor;
+  uint64_t stx_mnt_id;
+  uint64_t __spare3[13];
+};
+
+static const uint32_t STATX_MNT_ID_UNIQUE = 0x4000;
+
+} // namespace
+
+static const size_t LIST_BATCH = 1024;
+
+static const uint64_t STATMOUNT_MASK =
+  uapi::STATMOUNT_SB_BASIC |
+  uapi::STATMOUNT_MNT_BASIC |
+  uapi::STATMOUNT_PROPAGATE_FROM |
+  uapi::STATMOUNT_MNT_ROOT |
+  uapi::STATMOUNT_MNT_POINT |
+  uapi::STATMOUNT_FS_TYPE |
+  uapi::STATMOUNT_MNT_OPTS |
+  uapi::STATMOUNT_SB_SOURCE;
+
+static long listmount(uint64_t mnt_id, uint64_t last, uint64_t *ids, size_t count) {
+  uapi::mnt_id_req req = {};
+  req.size = uapi::MNT_ID_REQ_SIZE_VER0;
+  req.mnt_id = mnt_id;
+  req.param = last;
+  return syscall(SYS_listmount, &req, ids, count, 0);
+}
+
+// Appends the ids listmount() returns for mnt_id, following its pagination
+static void listIds(uint64_t mnt_id, vector<uint64_t> &ids) {
+  uint64_t last = 0;
+  while (true) {
+    auto used = ids.size();
+    ids.resize(used + LIST_BATCH);
+    auto count = listmount(mnt_id, last, ids.data() + used, LIST_BATCH);
+    if (count < 0) {
+      ids.resize(used);
+      // Unmounted since it was listed, along with anything below it
+      if (errno == ENOENT) return;
+      throw system_error(errno, generic_category(), "listmount failed");
+    }
+    ids.resize(used + count);
+    if (static_cast<size_t>(count) < LIST_BATCH) return;
+    last = ids.back();
+  }
+}
+
+// statmount() with a buffer reused across calls and grown on EOVERFLOW
+class StatMount {
+  vector<uint64_t> buffer_ = vector<uint64_t>(4096 / sizeof(uint64_t));
+public:
+  const uapi::statmount *operator ()(uint64_t mnt_id) {
+    uapi::mnt_id_req req = {};
+    req.size = uapi::MNT_ID_REQ_SIZE_VER0;
+    req.mnt_id = mnt_id;
+    req.param = STATMOUNT_MASK;
+    while (syscall(SYS_statmount, &req, buffer_.data(), buffer_.size() * sizeof(uint64_t), 0)) {
+      // The mount went away between listing and querying it, or is outside
+      // of what this process can see
+      if (errno == ENOENT || errno == EPERM || errno == EINVAL) return nullptr;
+      if (errno != EOVERFLOW) {
+        throw system_error(errno, generic_category(), "statmount failed");
+      }
+      buffer_.resize(buffer_.size() * 2);
+    }
+    return reinterpret_cast<const uapi::statmount *>(buffer_.data());
+  }
+};
+
+// Formats statmount results the way mountinfo shows them into one arena,
+// views are taken once the arena has stopped growing.
+class Arena {
+  string arena_;
+  vector<pair<size_t, size_t>> spans_;
+public:
+  void begin() { spans_.emplace_back(arena_.size(), 0); }
+  Arena &operator <<(string_view str) {
+    arena_.append(str);
+    spans_.back().second += str.size();
+    return *this;
+  }
+  Arena &operator <<(uint64_t num) {
+    return *this << string_view(to_string(num));
+  }
+  // Separated by sep from whatever this field already holds
+  Arena &append(string_view sep, string_view str) {
+    if (spans_.back().second) *this << sep;
+    return *this << str;
+  }
+  shared_ptr<const string> finish(vector<string_view> &views) {
+    auto buffer = make_shared<const string>(move(arena_));
+    views.reserve(spans_.size());
+    for (auto &span : spans_) {
+      views.emplace_back(buffer->data() + span.first, span.second);
+    }
+    return buffer;
+  }
+};
+
+static void formatMount(Arena &arena, const uapi::statmount &sm) {
+  auto str = [&](uint64_t flag, uint32_t offset) {
+    return sm.mask & flag ? string_view(sm.str + offset) : string_view();
+  };
+
+  arena.begin();
+  arena << static_cast<uint64_t>(sm.sb_dev_major) << ":" << static_cast<uint64_t>(sm.sb_dev_minor);
+  arena.begin();
+  arena << str(uapi::STATMOUNT_MNT_ROOT, sm.mnt_root);
+  arena.begin();
+  arena << str(uapi::STATMOUNT_MNT_POINT, sm.mnt_point);
+
+  arena.begin();
+  arena << (sm.mnt_attr & MOUNT_ATTR_RDONLY ? "ro" : "rw");
+  if (sm.mnt_attr & MOUNT_ATTR_NOSUID) arena << ",nosuid";
+  if (sm.mnt_attr & MOUNT_ATTR_NODEV) arena << ",nodev";
+  if (sm.mnt_attr & MOUNT_ATTR_NOEXEC) arena << ",noexec";
+  switch (sm.mnt_attr & MOUNT_ATTR__ATIME) {
+    case MOUNT_ATTR_NOATIME: arena << ",noatime"; break;
+    case MOUNT_ATTR_RELATIME: arena << ",relatime"; break;
+  }
+  if (sm.mnt_attr & MOUNT_ATTR_NODIRATIME) arena << ",nodiratime";
+  if (sm.mnt_attr & MOUNT_ATTR_NOSYMFOLLOW) arena << ",nosymfollow";
+  if (sm.mnt_attr & MOUNT_ATTR_IDMAP) arena << ",idmapped";
+
+  arena.begin();
+  if (sm.mnt_propagation & MS_SHARED) arena.append(" ", "shared:") << sm.mnt_peer_group;
+  if (sm.mnt_propagation & MS_SLAVE) {
+    arena.append(" ", "master:") << sm.mnt_master;
+    if ((sm.mask & uapi::STATMOUNT_PROPAGATE_FROM) && sm.propagate_from) {
+      arena << " propagate_from:" << sm.propagate_from;
+    }
+  }
+  if (sm.mnt_propagation & MS_UNBINDABLE) arena.append(" ", "unbindable");
+
+  arena.begin();
+  arena << str(uapi::STATMOUNT_FS_TYPE, sm.fs_type);
+  arena.begin();
+  auto source = str(uapi::STATMOUNT_SB_SOURCE, sm.sb_source);
+  arena << (source.empty() ? "none" : source);
+
+  arena.begin();
+  arena << (sm.sb_flags & MS_RDONLY ? "ro" : "rw");
+  if (sm.sb_flags & MS_SYNCHRONOUS) arena << ",sync";
+  if (sm.sb_flags & MS_DIRSYNC) arena << ",dirsync";
+  if (sm.sb_flags & MS_LAZYTIME) arena << ",lazytime";
+  // Escaped as in mountinfo, decoded the same way
+  string opts(str(uapi::STATMOUNT_MNT_OPTS, sm.mnt_opts));
+  opts.resize(parse::unescape(opts.data(), opts.data() + opts.size(), parse::SUPER_OPTIONS_ESCAPED));
+  if (!opts.empty()) arena << "," << opts;
+}
+
+static const size_t FIELD_COUNT = 8;
+
+bool MountTable::haveListMount() {
+  static const bool have = [] {
+    uint64_t id;
+    return listmount(uapi::LSMT_ROOT, 0, &id, 1) >= 0;
+  }();
+  return have;
+}
+
+// mnt_id is the unique id of the topmost mount at path, 0 if path is not a
+// mount point
+static uint64_t mountIdOf(const string &path, StatMount &stat) {
+  uapi::statx stx = {};
+  if (syscall(SYS_statx, AT_FDCWD, path.c_str(), AT_NO_AUTOMOUNT, uapi::STATX_MNT_ID_UNIQUE, &stx)) {
+    if (errno == ENOENT) return 0;
+    throw system_error(errno, generic_category(), "Failed to statx " + path);
+  }
+  if (!(stx.stx_mask & uapi::STATX_MNT_ID_UNIQUE)) {
+    throw system_error(ENOSYS, generic_category(), "No unique mount id for " + path);
+  }
+  auto sm = stat(stx.stx_mnt_id);
+  if (!sm || path != sm->str + sm->mnt_point) return 0;
+  // Walk down to the first mount at this path, further ones are stacked on it
+  auto id = stx.stx_mnt_id;
+  while (sm->mnt_parent_id != id) {
+    auto parent = sm->mnt_parent_id;
+    sm = stat(parent);
+    if (!sm || path != sm->str + sm->mnt_point) break;
+    id = parent;
+  }
+  return id;
+}
+
+MountTable MountTable::listFrom(uint64_t mnt_id, bool include_self) {
+  MountTable table;
+  StatMount stat;
+  Arena arena;
+  vector<uint64_t> ids;
+  if (include_self) ids.push_back(mnt_id);
+  listIds(mnt_id, ids);
+
+  // Kernels before 6.11 only list direct children, so keep listing below
+  // each mount unless the first listing already reached further down.
+  bool recursive = false;
+  size_t listed = ids.size();
+  for (size_t i = 0; i < ids.size(); ++i) {
+    auto sm = stat(ids[i]);
+    if (sm) {
+      if (i < listed && ids[i] != mnt_id && sm->mnt_parent_id != mnt_id) recursive = true;
+      ProcMountInfo mnt;
+      mnt.mount_id = sm->mnt_id;
+      mnt.parent_id = sm->mnt_parent_id;
+      formatMount(arena, *sm);
+      table.mounts_.push_back(mnt);
+    }
+    // Even when the mount has vanished since, or the last one listed would
+    // take the levels below every other one with it
+    if (i + 1 == listed && !recursive) {
+      for (size_t j = include_self ? 1 : 0; j < listed; ++j) listIds(ids[j], ids);
+    } else if (i >= listed && !recursive && sm) {
+      listIds(ids[i], ids);
+    }
+  }
+
+  vector<string_view> views;
+  table.buffers_.push_back(arena.finish(views));
+  for (TIndex i = 0; i < table.mounts_.size(); ++i) {
+    auto &mnt = table.mounts_[i];
+    auto field = views.begin() + i * FIELD_COUNT;
+    mnt.major_minor = *field++;
+    mnt.root = *field++;
+    mnt.mount_point = *field++;
+    mnt.options = *field++;
+    mnt.optional_fields = *field++;
+    mnt.filesystem = *field++;
+    mnt.source = *field++;
+    mnt.super_options = *field++;
+  }
+
+  table.by_mount_id_.reserve(table.mounts_.size());
+  for (TIndex i = 0; i < table.mounts_.size(); ++i) {
+    table.by_mount_id_.emplace(table.mounts_[i].mount_id, i);
+  }
+  for (TIndex i = 0; i < table.mounts_.size(); ++i) {
+    table.link(i);
+  }
+  return table;
+}
+
+MountTable MountTable::list() {
+  if (!haveListMount()) return read();
+  StatMount stat;
+  return listFrom(mountIdOf("/", stat), true);
+}
+
+MountTable MountTable::listSubtree(const string &mount_point) {
+  if (!haveListMount()) {
+    auto table = read();
+    table.root_ = table.findMountPoint(mount_point);
+    // Lookups only cover the subtree, as with the syscall backend
+    table.by_mount_point_.reset();
+    return table;
+  }
+  StatMount stat;
+  auto id = mountIdOf(mount_point, stat);
+  if (!id) return MountTable();
+  return listFrom(id, true);
+}
+
+} // namespace
@@ -0,0 +1,125 @@
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <system_error>
+#include <tuple>
+
+#include "procmounts.hpp"
+#include "parse.hpp"
+
+namespace procmounts {
+
+using namespace std;
+
+// Each update that adds or changes mounts keeps its read buffer alive for the
+// new entries, compact once this many have piled up.
+static const size_t MAX_BUFFERS = 8;
+
+static bool sameMount(const ProcMountInfo &a, const ProcMountInfo &b) {
+  auto fields = [](const ProcMountInfo &m) {
+    return tie(
+      m.parent_id,
+      m.major_minor,
+      m.root,
+      m.mount_point,
+      m.options,
+      m.optional_fields,
+      m.filesystem,
+      m.source,
+      m.super_options
+    );
+  };
+  return fields(a) == fields(b);
+}
+
+MountWatcher::MountWatcher(string path) : path_(move(path)) {
+  fd_ = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0) {
+    throw system_error(errno, generic_category(), "Failed to open " + path_);
+  }
+  table_ = MountTable::fromBuffer(parse::readFd(fd_, path_), path_);
+}
+
+MountWatcher::~MountWatcher() {
+  if (fd_ >= 0) close(fd_);
+}
+
+size_t MountWatcher::wait(int timeout_ms) {
+  struct pollfd pfd = { fd_, POLLPRI, 0 };
+  while (true) {
+    int ret = poll(&pfd, 1, timeout_ms);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      throw system_error(errno, generic_category(), "Failed to poll " + path_);
+    }
+    if (ret == 0) return 0;
+    if (pfd.revents & (POLLPRI | POLLERR)) return update();
+    return 0;
+  }
+}
+
+void MountWatcher::emit(Event event, MountTable::TIndex index) const {
+  for (auto &cb : callbacks_) {
+    cb(event, table_, index);
+  }
+}
+
+// Re-reading and comparing the snapshot is linear in the size of mountinfo,
+// but the table, its links and its indexes are only touched for the mounts
+// that actually changed.
+size_t MountWatcher::update() {
+  auto buffer = parse::readFd(fd_, path_);
+  vector<ProcMountInfo> current;
+  MountTable::parseLines(*buffer, path_, current);
+
+  ++generation_;
+  seen_.resize(table_.slots(), 0);
+  vector<const ProcMountInfo *> added;
+  vector<pair<MountTable::TIndex, const ProcMountInfo *>> changed;
+  for (auto &mnt : current) {
+    auto index = table_.findMountId(mnt.mount_id);
+    if (index == MountTable::npos) {
+      added.push_back(&mnt);
+      continue;
+    }
+    seen_[index] = generation_;
+    if (!sameMount(table_[index], mnt)) changed.emplace_back(index, &mnt);
+  }
+
+  size_t events = 0;
+  for (MountTable::TIndex i = 0; i < table_.slots(); ++i) {
+    if (!table_.live(i) || seen_[i] == generation_) continue;
+    emit(Event::REMOVED, i);
+    table_.erase(i);
+    ++events;
+  }
+
+  // Insert before applying changes, a moved mount's new parent may be new
+  vector<MountTable::TIndex> inserted;
+  inserted.reserve(added.size());
+  for (auto mnt : added) {
+    inserted.push_back(table_.insert(*mnt));
+  }
+  for (auto &p : changed) {
+    table_.update(p.first, *p.second);
+    emit(Event::CHANGED, p.first);
+    ++events;
+  }
+  for (auto index : inserted) {
+    table_.link(index);
+  }
+  for (auto index : inserted) {
+    emit(Event::ADDED, index);
+    ++events;
+  }
+
+  if (!added.empty() || !changed.empty()) {
+    table_.buffers_.push_back(buffer);
+    if (table_.buffers_.size() > MAX_BUFFERS) table_.compact();
+  }
+  return events;
+}
+
+} // namespace
@@ -0,0 +1,372 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "mount.hpp"
+#include "squash.hpp"
+
+using namespace std;
+namespace fs = filesystem;
+
+namespace chroot_venv {
+
+namespace {
+
+// A directory of the merged tree and the layers contributing to it, top
+// layer first
+struct Task {
+  string rel;
+  vector<size_t> layers;
+};
+
+// Overlay metadata, which describes the layer rather than the file
+bool isOverlayXattr(const char *name) {
+  return !strncmp(name, "trusted.overlay.", 16) || !strncmp(name, "user.overlay.", 13);
+}
+
+bool isOpaque(int dirfd) {
+  char value[1];
+  for (auto name : { "trusted.overlay.opaque", "user.overlay.opaque" }) {
+    if (fgetxattr(dirfd, name, value, sizeof(value)) == 1 && value[0] == 'y') return true;
+  }
+  return false;
+}
+
+// Whether names, a list of xattrs, has a redirect or metacopy, which point
+// overlayfs at data elsewhere in the layers that a plain merge would miss
+bool isIndirect(const string &names) {
+  for (size_t pos = 0; pos < names.size(); pos += strlen(&names[pos]) + 1) {
+    auto name = &names[pos];
+    if (!isOverlayXattr(name)) continue;
+    auto key = strchr(name + 1, '.') + strlen(".overlay.");
+    if (!strcmp(key, "redirect") || !strcmp(key, "metacopy")) return true;
+  }
+  return false;
+}
+
+template <typename TList>
+bool isIndirect(TList list) {
+  auto size = list(nullptr, 0);
+  if (size <= 0) return false;
+  string names(size, '\0');
+  size = list(names.data(), names.size());
+  if (size <= 0) return false;
+  names.resize(size);
+  return isIndirect(names);
+}
+
+bool isIndirect(int fd) {
+  return isIndirect([&](char *list, size_t size) { return flistxattr(fd, list, size); });
+}
+
+// There is no listxattrat(), so name goes through the fd of its directory
+bool isIndirect(int dirfd, const char *name) {
+  auto path = "/proc/self/fd/" + to_string(dirfd) + "/" + name;
+  return isIndirect([&](char *list, size_t size) { return llistxattr(path.c_str(), list, size); });
+}
+
+bool isWhiteout(const struct stat &st) {
+  return S_ISCHR(st.st_mode) && st.st_rdev == makedev(0, 0);
+}
+
+bool copyXattrs(int src, int dst) {
+  auto size = flistxattr(src, nullptr, 0);
+  if (size <= 0) return size == 0 || errno == ENOTSUP;
+  string names(size, '\0');
+  size = flistxattr(src, names.data(), names.size());
+  if (size < 0) return false;
+  string value;
+  for (size_t pos = 0; pos < (size_t)size; pos += strlen(&names[pos]) + 1) {
+    auto name = &names[pos];
+    if (isOverlayXattr(name)) continue;
+    auto len = fgetxattr(src, name, nullptr, 0);
+    if (len < 0) return false;
+    value.resize(len);
+    len = fgetxattr(src, name, value.data(), value.size());
+    if (len < 0 || fsetxattr(dst, name, value.data(), len, 0)) return false;
+  }
+  return true;
+}
+
+// Owner before mode, as chown() clears the set-id bits
+bool copyMetadata(int src, int dst, const struct stat &st) {
+  return !fchown(dst, st.st_uid, st.st_gid)
+    && !fchmod(dst, st.st_mode & 07777)
+    && copyXattrs(src, dst);
+}
+
+class Squash {
+  vector<Fd> roots_;
+  Fd out_;
+
+  mutex mutex_;
+  condition_variable cv_;
+  deque<Task> queue_;
+  size_t busy_ = 0;
+  bool failed_ = false;
+  // Set once the tree is complete, creating entries would change them again
+  vector<pair<string, array<struct timespec, 2>>> dir_times_;
+
+  atomic<size_t> linked_ = 0;
+  atomic<size_t> cloned_ = 0;
+  atomic<size_t> copied_ = 0;
+
+  void push(Task task) {
+    lock_guard<mutex> lock(mutex_);
+    queue_.push_back(move(task));
+    cv_.notify_one();
+  }
+
+  bool copyFile(int srcdir, int outdir, const char *name, const struct stat &st) {
+    Fd src(openat(srcdir, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+    Fd dst(openat(outdir, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600));
+    if (!src || !dst) return false;
+    if (!ioctl(dst.get(), FICLONE, src.get())) {
+      ++cloned_;
+    } else {
+      off_t left = st.st_size;
+      while (left > 0) {
+        auto n = copy_file_range(src.get(), nullptr, dst.get(), nullptr, left, 0);
+        // Refused between most filesystems since Linux 5.19
+        if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS)) {
+          n = sendfile(dst.get(), src.get(), nullptr, left);
+        }
+        if (n < 0) return false;
+        // Shrunk since the stat
+        if (!n) break;
+        left -= n;
+      }
+      ++copied_;
+    }
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    return copyMetadata(src.get(), dst.get(), st) && !futimens(dst.get(), times);
+  }
+
+  // Hardlinks name into outdir, or recreates it where that crosses
+  // filesystems
+  bool place(int srcdir, int outdir, const char *name) {
+    if (!linkat(srcdir, name, outdir, name, 0)) {
+      ++linked_;
+      return true;
+    }
+    if (errno != EXDEV && errno != EMLINK) return false;
+
+    struct stat st;
+    if (fstatat(srcdir, name, &st, AT_SYMLINK_NOFOLLOW)) return false;
+    if (S_ISREG(st.st_mode)) return copyFile(srcdir, outdir, name, st);
+    if (S_ISLNK(st.st_mode)) {
+      string target(st.st_size + 1, '\0');
+      auto len = readlinkat(srcdir, name, target.data(), target.size());
+      if (len < 0) return false;
+      target.resize(len);
+      if (symlinkat(target.c_str(), outdir, name)) return false;
+    } else if (mknodat(outdir, name, st.st_mode, st.st_rdev)) {
+      return false;
+    }
+    ++copied_;
+    struct timespec times[2] = { st.st_atim, st.st_mtim };
+    return !fchownat(outdir, name, st.st_uid, st.st_gid, AT_SYMLINK_NOFOLLOW)
+      && (S_ISLNK(st.st_mode) || !fchmodat(outdir, name, st.st_mode & 07777, 0))
+      && !utimensat(outdir, name, times, AT_SYMLINK_NOFOLLOW);
+  }
+
+  // Creates the merged directory rel from the topmost contributor, src
+  bool makeDir(int src, const string &rel) {
+    struct stat st;
+    if (fstat(src, &st)) return false;
+    if (rel != "." && mkdirat(out_.get(), rel.c_str(), 0700)) return false;
+    Fd dir(openat(out_.get(), rel.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    if (!dir || !copyMetadata(src, dir.get(), st)) return false;
+    lock_guard<mutex> lock(mutex_);
+    dir_times_.push_back({ rel, { st.st_atim, st.st_mtim } });
+    return true;
+  }
+
+  bool merge(const Task &task) {
+    enum Kind { HIDDEN, OTHER, DIRECTORY };
+    struct Entry {
+      Kind kind;
+      // The layer an OTHER comes from, the contributors of a DIRECTORY
+      vector<size_t> layers;
+      // No further layers merge into a DIRECTORY
+      bool closed = false;
+    };
+
+    map<size_t, Fd> dirs;
+    map<string, Entry> entries;
+    for (auto layer : task.layers) {
+      Fd dirfd(openat(roots_[layer].get(), task.rel.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+      if (!dirfd) {
+        cerr << "Failed to open " << task.rel << " in layer " << layer << " " << strerror(errno) << endl;
+        return false;
+      }
+      DIR *dir = fdopendir(dup(dirfd.get()));
+      if (!dir) return false;
+      while (auto ent = readdir(dir)) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+        auto type = ent->d_type;
+        // Whiteouts are character devices, stat only those
+        if (type == DT_CHR || type == DT_UNKNOWN) {
+          struct stat st;
+          if (fstatat(dirfd.get(), ent->d_name, &st, AT_SYMLINK_NOFOLLOW)) continue;
+          type = isWhiteout(st) ? (unsigned char)DT_WHT : IFTODT(st.st_mode);
+        }
+        bool is_dir = type == DT_DIR;
+        auto it = entries.find(ent->d_name);
+        bool merged = it != entries.end() && it->second.kind == DIRECTORY && !it->second.closed;
+        // Only what ends up in the tree, a shadowed entry does not count
+        if (it != entries.end() && !merged) continue;
+        bool opaque = false;
+        bool indirect = false;
+        if (is_dir) {
+          Fd sub(openat(dirfd.get(), ent->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+          opaque = sub && isOpaque(sub.get());
+          indirect = sub && isIndirect(sub.get());
+        } else if (type == DT_REG && !merged) {
+          indirect = isIndirect(dirfd.get(), ent->d_name);
+        }
+        if (indirect) {
+          auto rel = task.rel == "." ? string(ent->d_name) : task.rel + "/" + ent->d_name;
+          cerr << "Cannot squash " << rel << " in layer " << layer << ", it has an overlay redirect or metacopy" << endl;
+          closedir(dir);
+          return false;
+        }
+
+        if (it != entries.end()) {
+          auto &entry = it->second;
+          // A lower non-directory ends the merge, as in overlayfs lookup
+          if (!is_dir) entry.closed = true;
+          else entry.layers.push_back(layer);
+          entry.closed |= opaque;
+          continue;
+        }
+        Entry entry;
+        entry.kind = type == DT_WHT ? HIDDEN : is_dir ? DIRECTORY : OTHER;
+        entry.layers = { layer };
+        entry.closed = opaque;
+        entries.emplace(ent->d_name, move(entry));
+      }
+      closedir(dir);
+      dirs.emplace(layer, move(dirfd));
+    }
+
+    Fd outdir(openat(out_.get(), task.rel.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    if (!outdir) return false;
+    for (auto &[name, entry] : entries) {
+      auto rel = task.rel == "." ? name : task.rel + "/" + name;
+      auto srcdir = dirs[entry.layers.front()].get();
+      if (entry.kind == OTHER) {
+        if (!place(srcdir, outdir.get(), name.c_str())) {
+          cerr << "Failed to squash " << rel << " " << strerror(errno) << endl;
+          return false;
+        }
+      } else if (entry.kind == DIRECTORY) {
+        Fd src(openat(srcdir, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        if (!src || !makeDir(src.get(), rel)) {
+          cerr << "Failed to create " << rel << " " << strerror(errno) << endl;
+          return false;
+        }
+        push({ rel, move(entry.layers) });
+      }
+    }
+    return true;
+  }
+
+  void worker() {
+    unique_lock<mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [&] { return failed_ || !queue_.empty() || !busy_; });
+      if (failed_ || queue_.empty()) break;
+      auto task = move(queue_.front());
+      queue_.pop_front();
+      ++busy_;
+      lock.unlock();
+      bool merged = merge(task);
+      lock.lock();
+      --busy_;
+      failed_ |= !merged;
+      cv_.notify_all();
+    }
+  }
+
+public:
+  bool run(const vector<string> &layers, int parent, const fs::path &dst, unsigned threads) {
+    vector<size_t> all;
+    for (auto &layer : layers) {
+      Fd root(open(layer.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+      if (!root) {
+        cerr << "Failed to open layer " << layer << " " << strerror(errno) << endl;
+        return false;
+      }
+      all.push_back(roots_.size());
+      roots_.push_back(move(root));
+    }
+    out_ = Fd(openat(parent, dst.filename().c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+    if (!out_ || !makeDir(roots_[0].get(), ".")) {
+      cerr << "Failed to set up " << dst << " " << strerror(errno) << endl;
+      return false;
+    }
+
+    queue_.push_back({ ".", all });
+    vector<thread> pool;
+    for (unsigned i = 1; i < max(threads, 1u); ++i) pool.emplace_back(&Squash::worker, this);
+    worker();
+    for (auto &t : pool) t.join();
+    if (failed_) return false;
+
+    for (auto &[rel, times] : dir_times_) {
+      if (utimensat(out_.get(), rel.c_str(), times.data(), AT_SYMLINK_NOFOLLOW)) {
+        cerr << "Failed to set times of " << rel << " " << strerror(errno) << endl;
+        return false;
+      }
+    }
+    cerr
+      << "Squashed " << layers.size() << " layers into " << dst << ": "
+      << linked_ << " hardlinked, " << cloned_ << " reflinked, " << copied_ << " copied" << endl;
+    return true;
+  }
+};
+
+} // namespace
+
+bool squashLayers(const vector<string> &layers, const fs::path &dst, unsigned threads) {
+  if (layers.empty()) {
+    cerr << "No layers to squash" << endl;
+    return false;
+  }
+  // Never following a symlink on the way, which would let whoever can
+  // write below the working directory point dst anywhere
+  struct open_how how = {};
+  how.flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+  how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+  auto parent_path = dst.parent_path().empty() ? fs::path(".") : dst.parent_path();
+  Fd parent(syscall(SYS_openat2, AT_FDCWD, parent_path.c_str(), &how, sizeof(how)));
+  if (!parent || mkdirat(parent.get(), dst.filename().c_str(), 0700)) {
+    cerr << "Failed to create " << dst << " " << strerror(errno) << endl;
+    return false;
+  }
+  if (Squash().run(layers, parent.get(), dst, threads)) return true;
+  error_code ec;
+  fs::remove_all(fs::path("/proc/self/fd") / to_string(parent.get()) / dst.filename(), ec);
+  return false;
+}
+
+} // namespace
@@ -0,0 +1,20 @@
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#pragma once
+
+namespace chroot_venv {
+
+// Merges overlay lower layers, top layer first, into one new directory at
+// dst, relative to and beneath the working directory, holding what an
+// overlay of them would show. Whiteouts hide entries of the layers below,
+// as do opaque directories and non-directories above a directory, and none
+// of them are written out. Files are hardlinked to their layer where dst
+// is on the same filesystem, and otherwise reflinked with FICLONE or
+// copied. Directories are merged on up to threads threads. Layers holding
+// overlay redirects or metacopy files are refused, as their data lives
+// elsewhere in the stack. A failed squash removes dst again.
+bool squashLayers(const std::vector<std::string> &layers, const std::filesystem::path &dst, unsigned threads);
+
+} // namespace
@@ -0,0 +1,109 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <limits.h>
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <system_error>
+
+#include "statestore.hpp"
+
+using namespace std;
+namespace fs = filesystem;
+
+namespace chroot_venv {
+
+// Escapes a path into a single file name, much like systemd-escape --path
+static string escape(const fs::path &path) {
+  auto str = path.native();
+  auto start = str.find_first_not_of('/');
+  if (start == string::npos) return "-";
+  string ret;
+  for (size_t i = start; i < str.size(); ++i) {
+    unsigned char c = str[i];
+    if (c == '/') {
+      ret += '-';
+    } else if (isalnum(c) || c == '_' || (c == '.' && !ret.empty()) || c == ':') {
+      ret += c;
+    } else {
+      char hex[5];
+      snprintf(hex, sizeof(hex), "\\x%02x", c);
+      ret += hex;
+    }
+  }
+  return ret;
+}
+
+optional<StateEntry> StateEntry::open(const fs::path &dir, const fs::path &dst) {
+  if (mkdir(dir.c_str(), 0755) && errno != EEXIST) {
+    cerr << "Failed to create " << dir << " " << strerror(errno) << endl;
+    return nullopt;
+  }
+  auto name = escape(dst);
+  if (name.size() + 5 > NAME_MAX) {
+    cerr << "Path " << dst << " is too long for the state store" << endl;
+    return nullopt;
+  }
+  StateEntry entry;
+  entry.record_ = dir / name;
+  entry.lock_path_ = dir / (name + ".lock");
+  entry.lock_ = Fd(::open(entry.lock_path_.c_str(), O_CREAT | O_RDONLY | O_CLOEXEC, 00664));
+  if (!entry.lock_) {
+    cerr << "Failed to open lock file " << entry.lock_path_ << " " << strerror(errno) << endl;
+    return nullopt;
+  }
+  return entry;
+}
+
+void StateEntry::lock() {
+  while (flock(lock_.get(), LOCK_EX)) {
+    if (errno == EINTR) continue;
+    throw system_error(errno, generic_category(), "Failed to lock " + record_.native());
+  }
+}
+
+void StateEntry::unlock() {
+  flock(lock_.get(), LOCK_UN);
+}
+
+optional<StateRecord> StateEntry::read() const {
+  ifstream file(record_);
+  StateRecord record;
+  if (!(file >> record.src >> record.dst >> record.refs)) return nullopt;
+  // Absent from records written before lingering detached
+  if (!(file >> record.lingers)) record.lingers = 0;
+  return record;
+}
+
+bool StateEntry::write(const StateRecord &record) const {
+  auto tmp = record_;
+  tmp += ".tmp";
+  {
+    ofstream file(tmp, ios::trunc);
+    file << record.src << " " << record.dst << " " << record.refs << " " << record.lingers << endl;
+    if (!file) {
+      cerr << "Error writing " << tmp << endl;
+      return false;
+    }
+  }
+  if (rename(tmp.c_str(), record_.c_str())) {
+    cerr << "Failed to replace " << record_ << " " << strerror(errno) << endl;
+    return false;
+  }
+  return true;
+}
+
+bool StateEntry::remove(bool with_lock) const {
+  if (unlink(record_.c_str()) && errno != ENOENT) {
+    cerr << "Failed to remove " << record_ << " " << strerror(errno) << endl;
+    return false;
+  }
+  if (with_lock) unlink(lock_path_.c_str());
+  return true;
+}
+
+} // namespace
@@ -0,0 +1,47 @@
+#include <filesystem>
+#include <optional>
+
+#include "mount.hpp"
+
+#pragma once
+
+namespace chroot_venv {
+
+// What the state store knows about a mounted build root
+struct StateRecord {
+  std::filesystem::path src;
+  std::filesystem::path dst;
+  // Invocations using a shared build root, 0 while it lingers
+  unsigned refs = 1;
+  // Bumped by every invocation that leaves it lingering, so only the last
+  // one to do so tears it down
+  unsigned lingers = 0;
+};
+
+// The state of one build root, kept in its own record file under the store
+// directory and guarded by its own lock file. Invocations on different
+// build roots never contend, and each operation touches a single small
+// file. Records are replaced by rename(), so a crash leaves either the old
+// or the new one.
+class StateEntry {
+  std::filesystem::path record_;
+  std::filesystem::path lock_path_;
+  Fd lock_;
+
+public:
+  // Opens the entry for dst in dir, creating dir if needed
+  static std::optional<StateEntry> open(const std::filesystem::path &dir, const std::filesystem::path &dst);
+
+  // BasicLockable, for std::unique_lock
+  void lock();
+  void unlock();
+
+  // The calls below expect the lock to be held
+  std::optional<StateRecord> read() const;
+  bool write(const StateRecord &record) const;
+  // Removes the record. Only an entry nobody else can open, such as a
+  // mktemp build root's, may also remove its lock file.
+  bool remove(bool with_lock = false) const;
+};
+
+} // namespace
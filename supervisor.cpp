@@ -0,0 +1,249 @@
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <iostream>
+
+#include "supervisor.hpp"
+
+using namespace std;
+
+namespace chroot_venv {
+
+ostream &operator<<(ostream &os, const ExitReason &reason) {
+  if (!reason.signaled) {
+    os << "exited with status " << reason.status;
+  } else {
+    os << "killed by signal " << reason.status;
+    if (auto name = sigabbrev_np(reason.status)) os << " (SIG" << name << ")";
+    if (reason.core_dumped) os << ", core dumped";
+  }
+  if (reason.timed_out) os << " after timing out";
+  return os;
+}
+
+// Raw syscalls, glibc only gained usable wrappers in 2.37
+int pidfdOpen(pid_t pid) {
+  return syscall(SYS_pidfd_open, pid, 0);
+}
+
+int pidfdSendSignal(int pidfd, int signum) {
+  return syscall(SYS_pidfd_send_signal, pidfd, signum, nullptr, 0);
+}
+
+optional<ExitReason> reap(int pidfd) {
+  siginfo_t info = {};
+  if (waitid(P_PIDFD, pidfd, &info, WEXITED)) return nullopt;
+  ExitReason reason;
+  reason.signaled = info.si_code != CLD_EXITED;
+  reason.core_dumped = info.si_code == CLD_DUMPED;
+  reason.status = info.si_status;
+  return reason;
+}
+
+static bool armTimer(int fd, chrono::milliseconds timeout) {
+  struct itimerspec spec = {};
+  auto ms = max<chrono::milliseconds::rep>(timeout.count(), 1);
+  spec.it_value.tv_sec = ms / 1000;
+  spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+  return !timerfd_settime(fd, 0, &spec, nullptr);
+}
+
+static bool sendSignal(int pidfd, int signum) {
+  if (!pidfdSendSignal(pidfd, signum) || errno == ESRCH) return true;
+  cerr << "Failed to send signal " << signum << " " << strerror(errno) << endl;
+  return false;
+}
+
+// Events carry the pid, shifted to leave room for telling a child's timer
+// apart from its pidfd and zero for the signalfd
+static bool addEvent(int epoll, int fd, uint64_t tag) {
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN;
+  ev.data.u64 = tag;
+  if (!epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &ev)) return true;
+  cerr << "Failed to add fd to epoll " << strerror(errno) << endl;
+  return false;
+}
+
+bool Supervisor::init() {
+  sigemptyset(&mask_);
+  sigaddset(&mask_, SIGINT);
+  sigaddset(&mask_, SIGTERM);
+  sigaddset(&mask_, SIGHUP);
+  if (sigprocmask(SIG_BLOCK, &mask_, &old_mask_)) {
+    cerr << "Failed to block signals " << strerror(errno) << endl;
+    return false;
+  }
+  signal_ = Fd(signalfd(-1, &mask_, SFD_CLOEXEC | SFD_NONBLOCK));
+  if (!signal_) {
+    cerr << "Failed to create signalfd " << strerror(errno) << endl;
+    return false;
+  }
+  epoll_ = Fd(epoll_create1(EPOLL_CLOEXEC));
+  if (!epoll_) {
+    cerr << "Failed to create epoll " << strerror(errno) << endl;
+    return false;
+  }
+  return addEvent(epoll_.get(), signal_.get(), 0);
+}
+
+void Supervisor::restoreMask() const {
+  sigprocmask(SIG_SETMASK, &old_mask_, nullptr);
+}
+
+bool Supervisor::watch(pid_t pid, chrono::milliseconds kill_timeout, chrono::milliseconds timeout) {
+  Child child;
+  child.pidfd = Fd(pidfdOpen(pid));
+  child.timer = Fd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK));
+  child.kill_timeout = kill_timeout;
+  if (!child.pidfd || !child.timer) {
+    cerr << "Failed to supervise " << pid << " " << strerror(errno) << endl;
+    return false;
+  }
+  uint64_t tag = (uint64_t)pid << 1;
+  if (!addEvent(epoll_.get(), child.pidfd.get(), tag)) return false;
+  if (!addEvent(epoll_.get(), child.timer.get(), tag | 1)) return false;
+  if (timeout.count() > 0 && !armTimer(child.timer.get(), timeout)) {
+    cerr << "Failed to arm timeout " << strerror(errno) << endl;
+    return false;
+  }
+  children_.emplace(pid, move(child));
+  return true;
+}
+
+bool Supervisor::terminate(pid_t pid, Child &child, int signum) {
+  child.terminating = true;
+  if (!sendSignal(child.pidfd.get(), signum)) return false;
+  if (armTimer(child.timer.get(), child.kill_timeout)) return true;
+  cerr << "Failed to arm kill timer for " << pid << " " << strerror(errno) << endl;
+  return false;
+}
+
+bool Supervisor::kill(pid_t pid, Child &child) {
+  if (child.killed) return true;
+  cerr << "Sending SIGKILL to " << pid << endl;
+  child.killed = true;
+  return sendSignal(child.pidfd.get(), SIGKILL);
+}
+
+optional<pair<pid_t, ExitReason>> Supervisor::next() {
+  while (!children_.empty()) {
+    struct epoll_event events[16];
+    int count = epoll_wait(epoll_.get(), events, 16, -1);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      cerr << "Failed to wait for events " << strerror(errno) << endl;
+      return nullopt;
+    }
+    for (int i = 0; i < count; ++i) {
+      auto tag = events[i].data.u64;
+      if (!tag) {
+        struct signalfd_siginfo info;
+        while (read(signal_.get(), &info, sizeof(info)) == sizeof(info)) {
+          cerr << "Interrupt signal (" << info.ssi_signo << ") received." << endl;
+          for (auto &[pid, child] : children_) {
+            if (!(interrupted_ ? kill(pid, child) : terminate(pid, child, info.ssi_signo))) return nullopt;
+          }
+          interrupted_ = true;
+        }
+        continue;
+      }
+      pid_t pid = tag >> 1;
+      auto it = children_.find(pid);
+      // Reaped earlier in this batch of events
+      if (it == children_.end()) continue;
+      auto &child = it->second;
+      if (tag & 1) {
+        uint64_t expirations;
+        if (read(child.timer.get(), &expirations, sizeof(expirations)) < 0) continue;
+        if (child.terminating) {
+          if (!kill(pid, child)) return nullopt;
+        } else {
+          cerr << "Timed out waiting for " << pid << endl;
+          child.timed_out = true;
+          if (!terminate(pid, child, SIGTERM)) return nullopt;
+        }
+        continue;
+      }
+      auto reason = reap(child.pidfd.get());
+      if (!reason) {
+        cerr << "Failed to reap " << pid << " " << strerror(errno) << endl;
+        return nullopt;
+      }
+      reason->timed_out = child.timed_out;
+      // Closing the fds takes them out of the epoll set
+      children_.erase(it);
+      return make_pair(pid, *reason);
+    }
+  }
+  return nullopt;
+}
+
+optional<ExitReason> Supervisor::wait(pid_t pid, chrono::milliseconds kill_timeout) {
+  if (!watch(pid, kill_timeout)) return nullopt;
+  auto exited = next();
+  if (!exited) return nullopt;
+  return exited->second;
+}
+
+bool terminate(const vector<pid_t> &pids, chrono::milliseconds kill_timeout) {
+  vector<pid_t> running;
+  vector<Fd> pidfds;
+  vector<struct pollfd> polled;
+  for (auto pid : pids) {
+    Fd pidfd(pidfdOpen(pid));
+    // Already gone
+    if (!pidfd && errno == ESRCH) continue;
+    if (!pidfd || !sendSignal(pidfd.get(), SIGTERM)) {
+      cerr << "Error killing process " << pid << endl;
+      return false;
+    }
+    running.push_back(pid);
+    polled.push_back({ pidfd.get(), POLLIN, 0 });
+    pidfds.push_back(move(pidfd));
+  }
+
+  // A pidfd polls readable once its process has exited. Returns how many
+  // processes are still running after timeout.
+  auto waitExit = [&](chrono::milliseconds timeout) -> optional<size_t> {
+    using clock = chrono::steady_clock;
+    auto deadline = clock::now() + timeout;
+    size_t left = 0;
+    for (auto &pfd : polled) left += pfd.fd >= 0;
+    while (left) {
+      auto ms = chrono::duration_cast<chrono::milliseconds>(deadline - clock::now()).count();
+      if (ms <= 0) break;
+      if (poll(polled.data(), polled.size(), ms) < 0 && errno != EINTR) {
+        cerr << "Failed to wait for processes " << strerror(errno) << endl;
+        return nullopt;
+      }
+      for (auto &pfd : polled) {
+        // Negative fds are skipped by later polls
+        if (pfd.fd >= 0 && pfd.revents) {
+          pfd.fd = -1;
+          --left;
+        }
+      }
+    }
+    return left;
+  };
+
+  auto left = waitExit(kill_timeout);
+  if (!left) return false;
+  if (!*left) return true;
+  for (size_t i = 0; i < polled.size(); ++i) {
+    if (polled[i].fd < 0) continue;
+    cerr << "Sending SIGKILL to " << running[i] << endl;
+    if (!sendSignal(pidfds[i].get(), SIGKILL)) return false;
+  }
+  left = waitExit(kill_timeout);
+  return left && !*left;
+}
+
+} // namespace
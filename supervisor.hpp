@@ -0,0 +1,84 @@
+#include <signal.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <map>
+#include <optional>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include "mount.hpp"
+
+#pragma once
+
+namespace chroot_venv {
+
+// How a supervised process ended
+struct ExitReason {
+  bool signaled = false;
+  bool core_dumped = false;
+  // Exit status, or the terminating signal if signaled
+  int status = 0;
+  // Sent SIGTERM after running past its timeout
+  bool timed_out = false;
+
+  // The status a shell would report, 128 + signal for a killed process
+  int exitCode() const { return signaled ? 128 + status : status; }
+};
+
+std::ostream &operator<<(std::ostream &os, const ExitReason &reason);
+
+int pidfdOpen(pid_t pid);
+int pidfdSendSignal(int pidfd, int signum);
+// Waits for the exited child behind pidfd
+std::optional<ExitReason> reap(int pidfd);
+
+// Waits for children in one epoll loop over their pidfds and timerfds and a
+// signalfd. SIGINT, SIGTERM and SIGHUP are forwarded to every child, which
+// then has its kill_timeout to exit before it is sent SIGKILL. A second
+// signal escalates straight away.
+class Supervisor {
+  struct Child {
+    Fd pidfd;
+    Fd timer;
+    std::chrono::milliseconds kill_timeout;
+    bool terminating = false;
+    bool killed = false;
+    bool timed_out = false;
+  };
+
+  sigset_t mask_;
+  sigset_t old_mask_;
+  Fd signal_;
+  Fd epoll_;
+  std::map<pid_t, Child> children_;
+  bool interrupted_ = false;
+
+  bool terminate(pid_t pid, Child &child, int signum);
+  bool kill(pid_t pid, Child &child);
+
+public:
+  // Blocks the supervised signals so they queue up for the signalfd rather
+  // than interrupting whatever is running
+  bool init();
+  // Restores the original signal mask, for a forked child before exec
+  void restoreMask() const;
+
+  // Adds pid to the supervised children. With a timeout it is sent SIGTERM
+  // once that has passed, and SIGKILL kill_timeout later.
+  bool watch(pid_t pid, std::chrono::milliseconds kill_timeout, std::chrono::milliseconds timeout = {});
+  // Waits for the next supervised child to exit and reaps it
+  std::optional<std::pair<pid_t, ExitReason>> next();
+  size_t running() const { return children_.size(); }
+  // Whether a signal has been received
+  bool interrupted() const { return interrupted_; }
+
+  std::optional<ExitReason> wait(pid_t pid, std::chrono::milliseconds kill_timeout);
+};
+
+// Sends SIGTERM to every process in pids, waits up to kill_timeout for all
+// of them to exit and SIGKILLs the rest
+bool terminate(const std::vector<pid_t> &pids, std::chrono::milliseconds kill_timeout);
+
+} // namespace
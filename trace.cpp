@@ -0,0 +1,86 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#include "json.hpp"
+#include "trace.hpp"
+
+using namespace std;
+namespace fs = filesystem;
+
+namespace chroot_venv {
+
+Tracer tracer;
+
+Tracer::~Tracer() {
+  if (fd_ >= 0) close(fd_);
+}
+
+bool Tracer::open(const fs::path &file) {
+  lines_ = file.extension() == ".jsonl";
+  fd_ = ::open(file.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (lines_ ? O_APPEND : O_TRUNC), 0644);
+  if (fd_ < 0) {
+    cerr << "Failed to open " << file << " " << strerror(errno) << endl;
+    return false;
+  }
+  pid_ = getpid();
+  origin_ = Clock::now();
+  wall_origin_ = chrono::system_clock::now();
+  enabled_ = true;
+  return true;
+}
+
+void Tracer::record(const char *category, string name, Clock::time_point start, Clock::time_point end, TArgs args, pid_t tid) {
+  lock_guard<mutex> lock(mutex_);
+  events_.push_back({ category, move(name), start, end - start, tid ? tid : gettid(), move(args) });
+}
+
+bool Tracer::write() {
+  if (!enabled_ || getpid() != pid_) return true;
+  lock_guard<mutex> lock(mutex_);
+  ostringstream os;
+  os << fixed << setprecision(3);
+  if (!lines_) os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  for (size_t i = 0; i < events_.size(); ++i) {
+    auto &event = events_[i];
+    auto ts = chrono::duration<double, micro>(wall_origin_.time_since_epoch() + (event.start - origin_));
+    os << "{\"name\":";
+    writeJsonString(os, event.name);
+    os
+      << ",\"cat\":\"" << event.category << "\",\"ph\":\"X\""
+      << ",\"ts\":" << ts.count()
+      << ",\"dur\":" << chrono::duration<double, micro>(event.duration).count()
+      << ",\"pid\":" << pid_ << ",\"tid\":" << event.tid;
+    if (!event.args.empty()) {
+      os << ",\"args\":{";
+      for (size_t j = 0; j < event.args.size(); ++j) {
+        if (j) os << ",";
+        writeJsonString(os, event.args[j].first);
+        os << ":";
+        writeJsonString(os, event.args[j].second);
+      }
+      os << "}";
+    }
+    os << "}" << (lines_ || i + 1 == events_.size() ? "\n" : ",\n");
+  }
+  if (!lines_) os << "]}\n";
+  events_.clear();
+
+  auto data = os.str();
+  for (size_t done = 0; done < data.size();) {
+    auto n = ::write(fd_, data.data() + done, data.size() - done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) {
+      cerr << "Failed to write trace " << strerror(errno) << endl;
+      return false;
+    }
+    done += n;
+  }
+  return true;
+}
+
+} // namespace
@@ -0,0 +1,94 @@
+#include <sys/types.h>
+
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#pragma once
+
+namespace chroot_venv {
+
+// Collects timed spans of a run for --trace, as Chrome trace events
+class Tracer {
+public:
+  using Clock = std::chrono::steady_clock;
+  using TArgs = std::vector<std::pair<const char *, std::string>>;
+
+private:
+  struct Event {
+    const char *category;
+    std::string name;
+    Clock::time_point start;
+    Clock::duration duration;
+    pid_t tid;
+    TArgs args;
+  };
+
+  bool enabled_ = false;
+  bool lines_ = false;
+  int fd_ = -1;
+  pid_t pid_ = 0;
+  // Lines the steady clock up with wall time, so spans of different runs
+  // can be put side by side
+  Clock::time_point origin_;
+  std::chrono::system_clock::time_point wall_origin_;
+  std::mutex mutex_;
+  std::vector<Event> events_;
+
+public:
+  ~Tracer();
+
+  // Starts collecting spans for file, appended as JSON lines if its name
+  // ends in .jsonl and replaced by a Chrome trace otherwise
+  bool open(const std::filesystem::path &file);
+  bool enabled() const { return enabled_; }
+  // Adds a span, by default on the calling thread's track
+  void record(const char *category, std::string name, Clock::time_point start, Clock::time_point end, TArgs args = {}, pid_t tid = 0);
+  // Writes the collected spans, in one write() for JSON lines so runs
+  // sharing the file do not interleave. Only the process that opened the
+  // trace writes it.
+  bool write();
+};
+
+// The spans of this process
+extern Tracer tracer;
+
+// Times its scope into the trace. Costs one branch while tracing is off.
+class TraceSpan {
+  const char *category_;
+  const char *name_;
+  Tracer::Clock::time_point start_;
+  Tracer::TArgs args_;
+  bool ended_ = false;
+
+public:
+  TraceSpan(const char *category, const char *name) : category_(category), name_(name) {
+    if (tracer.enabled()) start_ = Tracer::Clock::now();
+  }
+  TraceSpan(const TraceSpan &) = delete;
+  ~TraceSpan() { end(); }
+
+  // Shown with the span
+  void arg(const char *key, const std::string &value) {
+    if (tracer.enabled()) args_.emplace_back(key, value);
+  }
+  // Ends the span before its scope does
+  void end() {
+    if (ended_ || !tracer.enabled()) return;
+    ended_ = true;
+    tracer.record(category_, name_, start_, Tracer::Clock::now(), std::move(args_));
+  }
+  // Ends the span and starts the next one in its place
+  void next(const char *name) {
+    end();
+    name_ = name;
+    args_.clear();
+    ended_ = false;
+    if (tracer.enabled()) start_ = Tracer::Clock::now();
+  }
+};
+
+} // namespace
@@ -0,0 +1,228 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+#include "mount.hpp"
+#include "trash.hpp"
+
+using namespace std;
+namespace fs = filesystem;
+
+namespace chroot_venv {
+
+namespace {
+
+// Never following symlinks or crossing mounts on the way, so swapping a
+// directory for a symlink cannot point the walk elsewhere
+Fd openDir(int root, const string &rel) {
+  struct open_how how = {};
+  how.flags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC;
+  how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS | RESOLVE_NO_XDEV;
+  return Fd(syscall(SYS_openat2, root, rel.c_str(), &how, sizeof(how)));
+}
+
+bool isEmpty(int dirfd) {
+  DIR *dir = fdopendir(openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (!dir) return false;
+  bool empty = true;
+  while (auto ent = readdir(dir)) {
+    if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, "..")) {
+      empty = false;
+      break;
+    }
+  }
+  closedir(dir);
+  return empty;
+}
+
+// A directory being emptied, which goes once its listing and all its
+// subdirectories are done
+struct Dir {
+  string rel;
+  string name;
+  Dir *parent;
+  atomic<size_t> pending = 1;
+
+  Dir(string rel, string name, Dir *parent) : rel(move(rel)), name(move(name)), parent(parent) {}
+};
+
+class Purge {
+  int root_;
+
+  mutex mutex_;
+  condition_variable cv_;
+  // Stable addresses for the Dir pointers in queue_ and parent
+  deque<Dir> dirs_;
+  deque<Dir *> queue_;
+  size_t busy_ = 0;
+  atomic<bool> failed_ = false;
+
+  void push(Dir *parent, const string &name) {
+    lock_guard<mutex> lock(mutex_);
+    dirs_.emplace_back(parent ? parent->rel + "/" + name : name, name, parent);
+    queue_.push_back(&dirs_.back());
+    cv_.notify_one();
+  }
+
+  // Unlinks everything but directories in dirfd, the directory of dir or
+  // the root for none, and queues those instead
+  void empty(int dirfd, Dir *dir) {
+    DIR *stream = fdopendir(dup(dirfd));
+    if (!stream) {
+      failed_ = true;
+      return;
+    }
+    vector<string> subdirs;
+    while (auto ent = readdir(stream)) {
+      if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+      // unlink() tells directories apart where readdir() does not
+      if (ent->d_type != DT_DIR) {
+        if (!unlinkat(dirfd, ent->d_name, 0) || errno == ENOENT) continue;
+        if (errno != EISDIR) {
+          failed_ = true;
+          continue;
+        }
+      }
+      subdirs.emplace_back(ent->d_name);
+    }
+    closedir(stream);
+    if (dir) dir->pending += subdirs.size();
+    for (auto &name : subdirs) push(dir, name);
+  }
+
+  // Removes dir and then each parent it was the last one pending in
+  void done(Dir *dir) {
+    for (; dir && !--dir->pending; dir = dir->parent) {
+      Fd parent;
+      if (dir->parent && !(parent = openDir(root_, dir->parent->rel))) {
+        failed_ = true;
+        continue;
+      }
+      auto parentfd = dir->parent ? parent.get() : root_;
+      if (unlinkat(parentfd, dir->name.c_str(), AT_REMOVEDIR) && errno != ENOENT) failed_ = true;
+    }
+  }
+
+  void worker() {
+    unique_lock<mutex> lock(mutex_);
+    while (true) {
+      cv_.wait(lock, [&] { return !queue_.empty() || !busy_; });
+      if (queue_.empty()) break;
+      auto dir = queue_.front();
+      queue_.pop_front();
+      ++busy_;
+      lock.unlock();
+      auto dirfd = openDir(root_, dir->rel);
+      if (dirfd) empty(dirfd.get(), dir);
+      else if (errno != ENOENT) failed_ = true;
+      done(dir);
+      lock.lock();
+      --busy_;
+      cv_.notify_all();
+    }
+  }
+
+public:
+  explicit Purge(int root) : root_(root) {}
+
+  bool run(unsigned threads) {
+    empty(root_, nullptr);
+    vector<thread> pool;
+    for (unsigned i = 1; i < max(threads, 1u); ++i) pool.emplace_back(&Purge::worker, this);
+    worker();
+    for (auto &t : pool) t.join();
+    return !failed_;
+  }
+};
+
+} // namespace
+
+bool Trash::add(const fs::path &path) const {
+  if (mkdir(dir_.c_str(), 0700) && errno != EEXIST) {
+    cerr << "Failed to create " << dir_ << " " << strerror(errno) << endl;
+    return false;
+  }
+  Fd dirfd(open(dir_.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+  struct stat st;
+  if (!dirfd || fstat(dirfd.get(), &st)) {
+    cerr << "Failed to open " << dir_ << " " << strerror(errno) << endl;
+    return false;
+  }
+  // Anyone else writing to it could slip in what gets deleted
+  if (st.st_uid != geteuid() || st.st_mode & 077) {
+    cerr << dir_ << " is not a private directory" << endl;
+    return false;
+  }
+  static atomic<unsigned> counter = 0;
+  auto prefix = path.filename().string() + "." + to_string(getpid()) + ".";
+  while (true) {
+    auto name = prefix + to_string(counter++);
+    if (!renameat2(AT_FDCWD, path.c_str(), dirfd.get(), name.c_str(), RENAME_NOREPLACE)) return true;
+    if (errno != EEXIST) {
+      cerr << "Failed to move " << path << " to " << dir_ << " " << strerror(errno) << endl;
+      return false;
+    }
+  }
+}
+
+bool Trash::purge(unsigned threads) const {
+  Fd dirfd(open(dir_.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+  if (!dirfd) return errno == ENOENT;
+  // Whoever holds the lock looks again after releasing it, so an entry
+  // added while it was purging is not left behind
+  while (true) {
+    if (flock(dirfd.get(), LOCK_EX | LOCK_NB)) return errno == EWOULDBLOCK;
+    bool purged = Purge(dirfd.get()).run(threads);
+    flock(dirfd.get(), LOCK_UN);
+    if (!purged || isEmpty(dirfd.get())) return purged;
+  }
+}
+
+void Trash::purgeInBackground() const {
+  auto pid = fork();
+  if (pid == 0) {
+    if (fork() == 0) {
+      setsid();
+      sigset_t none;
+      sigemptyset(&none);
+      sigprocmask(SIG_SETMASK, &none, nullptr);
+      // Holding on to the caller's locks or the pipe its output goes to
+      // would keep others waiting for the purge
+      if (close_range(3, ~0U, 0)) {
+        for (long fd = 3; fd < sysconf(_SC_OPEN_MAX); ++fd) close(fd);
+      }
+      int null = open("/dev/null", O_RDWR);
+      for (int fd = 0; fd < 3; ++fd) dup2(null, fd);
+      if (null > 2) close(null);
+      setpriority(PRIO_PROCESS, 0, 10);
+      purge(max(thread::hardware_concurrency(), 1u));
+    }
+    _exit(0);
+  }
+  if (pid > 0) waitpid(pid, nullptr, 0);
+}
+
+bool discard(const fs::path &path, const Trash &trash) {
+  if (!trash.add(path)) return false;
+  trash.purgeInBackground();
+  return true;
+}
+
+} // namespace
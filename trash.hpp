@@ -0,0 +1,37 @@
+#include <filesystem>
+
+#pragma once
+
+namespace chroot_venv {
+
+// A directory of doomed trees next to the paths thrown into it, and so on
+// their filesystem, where a rename is enough to get rid of them
+class Trash {
+  std::filesystem::path dir_;
+
+public:
+  // The trash serving paths in parent
+  explicit Trash(const std::filesystem::path &parent) : dir_(parent / ".trash") {}
+
+  const std::filesystem::path &path() const { return dir_; }
+
+  // Atomically moves path into the trash. Returns false, leaving path in
+  // place, if that fails.
+  bool add(const std::filesystem::path &path) const;
+  // Removes everything in the trash on up to threads threads. Returns
+  // early if another process is purging it already, which then also takes
+  // anything added meanwhile.
+  bool purge(unsigned threads) const;
+  // Purges from a detached process, which outlives the caller
+  void purgeInBackground() const;
+};
+
+// Moves path into trash and purges that in the background, so the caller
+// does not wait for a large tree to go
+bool discard(const std::filesystem::path &path, const Trash &trash);
+
+inline bool discard(const std::filesystem::path &path) {
+  return discard(path, Trash(path.parent_path()));
+}
+
+} // namespace
@@ -0,0 +1,387 @@
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+
+#include "supervisor.hpp"
+#include "zygote.hpp"
+
+using namespace std;
+namespace fs = filesystem;
+
+extern char **environ;
+
+namespace chroot_venv {
+
+// Sent with the fds attached, followed by size bytes of payload: the dst
+// number of each fd as int32_t, then NUL terminated cwd and argv
+struct RequestHeader {
+  uint32_t size;
+  uint32_t argc;
+  uint32_t nfds;
+};
+
+struct Reply {
+  int32_t signaled;
+  int32_t core_dumped;
+  int32_t status;
+};
+
+// The most fds one SCM_RIGHTS message can carry
+static const size_t MAX_FDS = 253;
+
+struct Request {
+  TFdMap fds;
+  // Owns the received fds until they are moved into place
+  vector<Fd> received;
+  string cwd;
+  vector<string> args;
+};
+
+static sockaddr_un address(const fs::path &path) {
+  sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  return addr;
+}
+
+static bool readAll(int fd, void *data, size_t size) {
+  auto ptr = static_cast<char *>(data);
+  while (size) {
+    auto len = read(fd, ptr, size);
+    if (len < 0 && errno == EINTR) continue;
+    if (len <= 0) return false;
+    ptr += len;
+    size -= len;
+  }
+  return true;
+}
+
+static bool writeAll(int fd, const void *data, size_t size) {
+  auto ptr = static_cast<const char *>(data);
+  while (size) {
+    auto len = write(fd, ptr, size);
+    if (len < 0 && errno == EINTR) continue;
+    if (len <= 0) return false;
+    ptr += len;
+    size -= len;
+  }
+  return true;
+}
+
+Fd listenZygote(const fs::path &path) {
+  if (path.native().size() >= sizeof(sockaddr_un::sun_path)) {
+    cerr << "Socket path " << path << " is too long" << endl;
+    return Fd();
+  }
+  Fd sock(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (!sock) {
+    cerr << "Failed to create socket " << strerror(errno) << endl;
+    return sock;
+  }
+  auto addr = address(path);
+  // A socket nobody accepts on is left over from a daemon that died
+  if (!connect(sock.get(), (sockaddr *)&addr, sizeof(addr))) {
+    cerr << "A daemon is already listening on " << path << endl;
+    return Fd();
+  }
+  unlink(path.c_str());
+  if (
+    bind(sock.get(), (sockaddr *)&addr, sizeof(addr)) ||
+    chown(path.c_str(), getuid(), getgid()) ||
+    chmod(path.c_str(), 0600) ||
+    listen(sock.get(), SOMAXCONN)
+  ) {
+    cerr << "Failed to listen on " << path << " " << strerror(errno) << endl;
+    return Fd();
+  }
+  return sock;
+}
+
+// Receives the header of a request and its fds into request, without
+// waiting for a client that has not sent them yet
+static bool receiveHeader(int conn, RequestHeader &header, Request &request) {
+  iovec iov = { &header, sizeof(header) };
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  auto len = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+
+  for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (size_t i = 0; i < count; ++i) {
+      int fd;
+      memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+      request.received.emplace_back(fd);
+    }
+  }
+  if (len != sizeof(header) || msg.msg_flags & MSG_CTRUNC) return false;
+  // More than execve() would take is never a command
+  return header.nfds == request.received.size()
+    && header.size >= header.nfds * sizeof(int32_t)
+    && header.size <= (size_t)sysconf(_SC_ARG_MAX);
+}
+
+// Fills in request from the payload that followed header
+static bool parsePayload(const RequestHeader &header, const string &payload, Request &request) {
+  for (size_t i = 0; i < header.nfds; ++i) {
+    int32_t dst;
+    memcpy(&dst, payload.data() + i * sizeof(dst), sizeof(dst));
+    if (dst < 0 || !request.fds.emplace(dst, request.received[i].get()).second) return false;
+  }
+
+  // The strings, each one NUL terminated
+  vector<string> strings;
+  size_t pos = header.nfds * sizeof(int32_t);
+  while (pos < payload.size()) {
+    auto end = payload.find('\0', pos);
+    if (end == string::npos) return false;
+    strings.push_back(payload.substr(pos, end - pos));
+    pos = end + 1;
+  }
+  if (strings.size() != 1 + header.argc) return false;
+  request.cwd = strings[0];
+  request.args.assign(strings.begin() + 1, strings.end());
+  return true;
+}
+
+// Runs in the forked child and never returns
+[[noreturn]] static void execRequest(const Request &request) {
+  if (!inheritFds(request.fds)) exit(-1);
+  // A cwd missing inside the chroot keeps the zygote's, the configured cwd
+  if (chdir(request.cwd.c_str()) && errno != ENOENT && errno != ENOTDIR) {
+    cerr << "Failed to change directory to " << request.cwd << " " << strerror(errno) << endl;
+    exit(-1);
+  }
+  vector<const char *> argv;
+  for (auto &arg : request.args) argv.push_back(arg.c_str());
+  argv.push_back(nullptr);
+  execve(argv[0], (char *const *)argv.data(), environ);
+  cerr << "Failed to exec " << argv[0] << " " << strerror(errno) << endl;
+  exit(-1);
+}
+
+namespace {
+
+struct Job {
+  pid_t pid;
+  Fd pidfd;
+  Fd conn;
+  Fd timer;
+  bool hungup = false;
+};
+
+// A connection whose request is still coming in
+struct Pending {
+  Fd conn;
+  optional<RequestHeader> header;
+  string payload;
+  size_t received = 0;
+  Request request;
+};
+
+}
+
+int runZygote(Fd listener, chrono::milliseconds kill_timeout, const TZygoteCommand &command) {
+  Fd epoll(epoll_create1(EPOLL_CLOEXEC));
+  if (!epoll) {
+    cerr << "Failed to create epoll " << strerror(errno) << endl;
+    return 1;
+  }
+  auto watch = [&](int fd, uint32_t events) {
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.fd = fd;
+    return !epoll_ctl(epoll.get(), EPOLL_CTL_ADD, fd, &ev);
+  };
+  if (!watch(listener.get(), EPOLLIN)) {
+    cerr << "Failed to watch listener " << strerror(errno) << endl;
+    return 1;
+  }
+
+  // Every fd of a job maps to it
+  map<int, shared_ptr<Job>> jobs;
+  map<int, Pending> pending;
+  auto finish = [&](shared_ptr<Job> job) {
+    auto reason = reap(job->pidfd.get());
+    if (reason && !job->hungup) {
+      Reply reply = { reason->signaled, reason->core_dumped, reason->status };
+      writeAll(job->conn.get(), &reply, sizeof(reply));
+    }
+    for (int fd : { job->pidfd.get(), job->conn.get(), job->timer.get() }) jobs.erase(fd);
+  };
+
+  while (true) {
+    epoll_event events[16];
+    int count = epoll_wait(epoll.get(), events, 16, -1);
+    if (count < 0) {
+      if (errno == EINTR) continue;
+      cerr << "Failed to wait for events " << strerror(errno) << endl;
+      return 1;
+    }
+    for (int i = 0; i < count; ++i) {
+      int fd = events[i].data.fd;
+      if (fd == listener.get()) {
+        // Non-blocking, so a client that stalls halfway through its request
+        // holds up nobody else
+        Fd conn(accept4(listener.get(), nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK));
+        if (!conn) continue;
+        ucred cred;
+        socklen_t cred_len = sizeof(cred);
+        if (getsockopt(conn.get(), SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) || cred.uid != getuid()) {
+          cerr << "Refusing connection from another user" << endl;
+          continue;
+        }
+        if (!watch(conn.get(), EPOLLIN)) continue;
+        int conn_fd = conn.get();
+        pending[conn_fd].conn = move(conn);
+        continue;
+      }
+
+      if (auto it = pending.find(fd); it != pending.end()) {
+        auto &p = it->second;
+        bool ok = true;
+        if (!p.header) {
+          RequestHeader header;
+          ok = receiveHeader(fd, header, p.request);
+          if (ok) {
+            p.header = header;
+            p.payload.resize(header.size);
+          }
+        } else {
+          auto len = read(fd, p.payload.data() + p.received, p.payload.size() - p.received);
+          if (len < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+          ok = len > 0;
+          if (ok) p.received += len;
+        }
+        if (ok && p.received < p.payload.size()) continue;
+        ok = ok && parsePayload(*p.header, p.payload, p.request);
+        auto request = move(p.request);
+        Fd conn = move(p.conn);
+        pending.erase(it);
+        epoll_ctl(epoll.get(), EPOLL_CTL_DEL, fd, nullptr);
+        if (!ok) {
+          cerr << "Dropping malformed request" << endl;
+          continue;
+        }
+        request.args = command(move(request.args));
+        auto pid = fork();
+        if (pid == 0) execRequest(request);
+        if (pid < 0) {
+          cerr << "Failed to fork " << strerror(errno) << endl;
+          continue;
+        }
+        auto job = make_shared<Job>();
+        job->pid = pid;
+        job->pidfd = Fd(pidfdOpen(pid));
+        job->conn = move(conn);
+        job->timer = Fd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK));
+        if (!job->pidfd || !job->timer || !watch(job->pidfd.get(), EPOLLIN) || !watch(job->conn.get(), EPOLLRDHUP)) {
+          cerr << "Failed to watch " << pid << " " << strerror(errno) << endl;
+          kill(pid, SIGKILL);
+          waitpid(pid, nullptr, 0);
+          continue;
+        }
+        watch(job->timer.get(), EPOLLIN);
+        for (int job_fd : { job->pidfd.get(), job->conn.get(), job->timer.get() }) jobs[job_fd] = job;
+        continue;
+      }
+
+      auto it = jobs.find(fd);
+      if (it == jobs.end()) continue;
+      auto job = it->second;
+      if (fd == job->pidfd.get()) {
+        finish(job);
+      } else if (fd == job->conn.get() && !job->hungup) {
+        // The client went away, give its command the same grace period a
+        // signal to the supervisor would
+        job->hungup = true;
+        epoll_ctl(epoll.get(), EPOLL_CTL_DEL, fd, nullptr);
+        pidfdSendSignal(job->pidfd.get(), SIGTERM);
+        itimerspec spec = {};
+        auto ms = max<chrono::milliseconds::rep>(kill_timeout.count(), 1);
+        spec.it_value.tv_sec = ms / 1000;
+        spec.it_value.tv_nsec = (ms % 1000) * 1000000;
+        timerfd_settime(job->timer.get(), 0, &spec, nullptr);
+      } else if (fd == job->timer.get()) {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) > 0) pidfdSendSignal(job->pidfd.get(), SIGKILL);
+      }
+    }
+  }
+}
+
+int runClient(const fs::path &path, const vector<string> &args, const fs::path &cwd, const TFdMap &keepfd) {
+  Fd sock(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  auto addr = address(path);
+  if (!sock || connect(sock.get(), (sockaddr *)&addr, sizeof(addr))) {
+    cerr << "Failed to connect to " << path << " " << strerror(errno) << endl;
+    return 1;
+  }
+
+  TFdMap fds = { { 0, 0 }, { 1, 1 }, { 2, 2 } };
+  for (auto &[dst, src] : keepfd) fds[dst] = src;
+  if (fds.size() > MAX_FDS) {
+    cerr << "Too many fds to pass" << endl;
+    return 1;
+  }
+
+  string payload;
+  vector<int> srcs;
+  for (auto &[dst, src] : fds) {
+    int32_t dst32 = dst;
+    payload.append((const char *)&dst32, sizeof(dst32));
+    srcs.push_back(src);
+  }
+  payload.append(cwd.native());
+  payload.push_back('\0');
+  for (auto &arg : args) {
+    payload.append(arg);
+    payload.push_back('\0');
+  }
+
+  RequestHeader header = { (uint32_t)payload.size(), (uint32_t)args.size(), (uint32_t)srcs.size() };
+  iovec iov = { &header, sizeof(header) };
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_FDS)] = {};
+  msghdr msg = {};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE(sizeof(int) * srcs.size());
+  auto cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * srcs.size());
+  memcpy(CMSG_DATA(cmsg), srcs.data(), sizeof(int) * srcs.size());
+  if (sendmsg(sock.get(), &msg, 0) != sizeof(header) || !writeAll(sock.get(), payload.data(), payload.size())) {
+    cerr << "Failed to send request " << strerror(errno) << endl;
+    return 1;
+  }
+
+  Reply reply;
+  if (!readAll(sock.get(), &reply, sizeof(reply))) {
+    cerr << "Lost connection to the daemon" << endl;
+    return 1;
+  }
+  ExitReason reason = { !!reply.signaled, !!reply.core_dumped, reply.status };
+  if (reason.signaled || reason.status) cerr << (args.empty() ? "command" : args[0]) << " " << reason << endl;
+  return reason.exitCode();
+}
+
+} // namespace
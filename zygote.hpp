@@ -0,0 +1,36 @@
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "fds.hpp"
+#include "mount.hpp"
+
+#pragma once
+
+namespace chroot_venv {
+
+// Daemon mode keeps a build root mounted and a zygote process chrooted
+// inside it. Clients send a command's argv, cwd and fds over a unix socket
+// with SCM_RIGHTS and the zygote forks and execs it at once, then sends the
+// exit reason back over the same connection.
+
+// Creates the listening socket at path, usable only by the real uid
+Fd listenZygote(const std::filesystem::path &path);
+
+// Turns the argv a client sent into the one to exec
+using TZygoteCommand = std::function<std::vector<std::string>(std::vector<std::string>)>;
+
+// Serves commands on listener until it is killed, each built by command
+// and run with the zygote's environment, never the client's. Requests are
+// read as they arrive, so a stalled client holds up no one else. A client
+// hanging up SIGTERMs its command, then SIGKILLs it after kill_timeout.
+int runZygote(Fd listener, std::chrono::milliseconds kill_timeout, const TZygoteCommand &command);
+
+// Runs args in cwd through the zygote listening at path, passing stdio and
+// the fds in keepfd, and returns the command's exit code. Where cwd does not
+// exist inside the chroot the command runs in the chroot's configured cwd.
+int runClient(const std::filesystem::path &path, const std::vector<std::string> &args, const std::filesystem::path &cwd, const TFdMap &keepfd);
+
+} // namespace